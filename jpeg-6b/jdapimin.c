@@ -207,6 +207,8 @@ default_decompress_parms (j_decompress_ptr cinfo)
   cinfo->enable_1pass_quant = FALSE;
   cinfo->enable_external_quant = FALSE;
   cinfo->enable_2pass_quant = FALSE;
+  /* Zebaoth-specific extension: no vertical doubling. */
+  cinfo->dbl_row_offset = 0;
 }
 
 
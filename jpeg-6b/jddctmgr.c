@@ -19,6 +19,7 @@
 #include "jinclude.h"
 #include "jpeglib.h"
 #include "jdct.h"		/* Private declarations for DCT subsystem */
+#include "jsimd.h"
 
 
 /*
@@ -124,6 +125,11 @@ start_pass (j_decompress_ptr cinfo)
 #ifdef DCT_IFAST_SUPPORTED
       case JDCT_IFAST:
 	method_ptr = jpeg_idct_ifast;
+#ifdef JSIMD_SUPPORTED
+	/* Use a vector version with identical output, if we have one */
+	if (jsimd_idct_ifast_method() != NULL)
+	  method_ptr = jsimd_idct_ifast_method();
+#endif
 	method = JDCT_IFAST;
 	break;
 #endif
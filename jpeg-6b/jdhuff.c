@@ -138,6 +138,32 @@ start_pass_huff_decoder (j_decompress_ptr cinfo)
 }
 
 
+/*
+ * Figure F.12: extend sign bit.
+ * On some machines, a shift and add will be faster than a table lookup.
+ */
+
+#ifdef AVOID_TABLES
+
+#define HUFF_EXTEND(x,s)  ((x) < (1<<((s)-1)) ? (x) + (((-1)<<(s)) + 1) : (x))
+
+#else
+
+#define HUFF_EXTEND(x,s)  ((x) < extend_test[s] ? (x) + extend_offset[s] : (x))
+
+static const int extend_test[16] =   /* entry n is 2**(n-1) */
+  { 0, 0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+    0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000 };
+
+static const int extend_offset[16] = /* entry n is (-1 << n) + 1 */
+  { 0, ((-1)<<1) + 1, ((-1)<<2) + 1, ((-1)<<3) + 1, ((-1)<<4) + 1,
+    ((-1)<<5) + 1, ((-1)<<6) + 1, ((-1)<<7) + 1, ((-1)<<8) + 1,
+    ((-1)<<9) + 1, ((-1)<<10) + 1, ((-1)<<11) + 1, ((-1)<<12) + 1,
+    ((-1)<<13) + 1, ((-1)<<14) + 1, ((-1)<<15) + 1 };
+
+#endif /* AVOID_TABLES */
+
+
 /*
  * Compute the derived values for a Huffman table.
  * This routine also performs some validation checks on the table.
@@ -250,6 +276,41 @@ jpeg_make_d_derived_tbl (j_decompress_ptr cinfo, boolean isDC, int tblno,
     }
   }
 
+  /* Compute the combined lookahead table.  Each entry covers a code of
+   * at most HUFF_LOOKAHEAD bits (found via the table just built) plus the
+   * value bits following it, when all of them fit in HUFF_FAST_BITS.
+   */
+
+  for (lookbits = 0; lookbits < (1 << HUFF_FAST_BITS); lookbits++) {
+    int look = lookbits >> (HUFF_FAST_BITS - HUFF_LOOKAHEAD);
+    int sym, run, size, val;
+
+    dtbl->look_fast[lookbits] = 0;
+    if ((l = dtbl->look_nbits[look]) == 0)
+      continue;
+    sym = dtbl->look_sym[look];
+    if (isDC) {
+      run = 0;
+      size = sym;
+      if (size > 15)
+	continue;		/* rejected below */
+    } else {
+      run = sym >> 4;
+      size = sym & 15;
+      if (size == 0)
+	continue;		/* EOB or ZRL */
+    }
+    if (l + size > HUFF_FAST_BITS)
+      continue;
+    val = 0;
+    if (size) {
+      /* Figure F.12: extend sign bit */
+      val = (lookbits >> (HUFF_FAST_BITS - l - size)) & ((1 << size) - 1);
+      val = HUFF_EXTEND(val, size);
+    }
+    dtbl->look_fast[lookbits] = (INT32) val * 65536 + (run << 8) + l + size;
+  }
+
   /* Validate symbols as being reasonable.
    * For AC tables, we make no check, but accept all byte values 0..255.
    * For DC tables, we require the symbols to be in range 0..15.
@@ -433,31 +494,6 @@ jpeg_huff_decode (bitread_working_state * state,
 }
 
 
-/*
- * Figure F.12: extend sign bit.
- * On some machines, a shift and add will be faster than a table lookup.
- */
-
-#ifdef AVOID_TABLES
-
-#define HUFF_EXTEND(x,s)  ((x) < (1<<((s)-1)) ? (x) + (((-1)<<(s)) + 1) : (x))
-
-#else
-
-#define HUFF_EXTEND(x,s)  ((x) < extend_test[s] ? (x) + extend_offset[s] : (x))
-
-static const int extend_test[16] =   /* entry n is 2**(n-1) */
-  { 0, 0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
-    0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000 };
-
-static const int extend_offset[16] = /* entry n is (-1 << n) + 1 */
-  { 0, ((-1)<<1) + 1, ((-1)<<2) + 1, ((-1)<<3) + 1, ((-1)<<4) + 1,
-    ((-1)<<5) + 1, ((-1)<<6) + 1, ((-1)<<7) + 1, ((-1)<<8) + 1,
-    ((-1)<<9) + 1, ((-1)<<10) + 1, ((-1)<<11) + 1, ((-1)<<12) + 1,
-    ((-1)<<13) + 1, ((-1)<<14) + 1, ((-1)<<15) + 1 };
-
-#endif /* AVOID_TABLES */
-
 
 /*
  * Check for a restart marker & resynchronize decoder.
@@ -498,6 +534,319 @@ process_restart (j_decompress_ptr cinfo)
 }
 
 
+/*
+ * Decode one MCU the careful way, a byte at a time, coping with suspension
+ * and with markers in the data.  This is the original IJG decoder; it is
+ * always exact, and is the fallback whenever the fast path can't be used.
+ */
+
+LOCAL(boolean)
+decode_mcu_slow (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  int blkn;
+  BITREAD_STATE_VARS;
+  savable_state state;
+
+  /* Load up working state */
+  BITREAD_LOAD_STATE(cinfo,entropy->bitstate);
+  ASSIGN_STATE(state, entropy->saved);
+
+  /* Outer loop handles each block in the MCU */
+
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
+    JBLOCKROW block = MCU_data[blkn];
+    d_derived_tbl * dctbl = entropy->dc_cur_tbls[blkn];
+    d_derived_tbl * actbl = entropy->ac_cur_tbls[blkn];
+    register int s, k, r;
+
+    /* Decode a single block's worth of coefficients */
+
+    /* Section F.2.2.1: decode the DC coefficient difference */
+    HUFF_DECODE(s, br_state, dctbl, return FALSE, label1);
+    if (s) {
+      CHECK_BIT_BUFFER(br_state, s, return FALSE);
+      r = GET_BITS(s);
+      s = HUFF_EXTEND(r, s);
+    }
+
+    if (entropy->dc_needed[blkn]) {
+      /* Convert DC difference to actual value, update last_dc_val */
+      int ci = cinfo->MCU_membership[blkn];
+      s += state.last_dc_val[ci];
+      state.last_dc_val[ci] = s;
+      /* Output the DC coefficient (assumes jpeg_natural_order[0] = 0) */
+      (*block)[0] = (JCOEF) s;
+    }
+
+    if (entropy->ac_needed[blkn]) {
+
+      /* Section F.2.2.2: decode the AC coefficients */
+      /* Since zeroes are skipped, output area must be cleared beforehand */
+      for (k = 1; k < DCTSIZE2; k++) {
+	HUFF_DECODE(s, br_state, actbl, return FALSE, label2);
+      
+	r = s >> 4;
+	s &= 15;
+      
+	if (s) {
+	  k += r;
+	  CHECK_BIT_BUFFER(br_state, s, return FALSE);
+	  r = GET_BITS(s);
+	  s = HUFF_EXTEND(r, s);
+	  /* Output coefficient in natural (dezigzagged) order.
+	   * Note: the extra entries in jpeg_natural_order[] will save us
+	   * if k >= DCTSIZE2, which could happen if the data is corrupted.
+	   */
+	  (*block)[jpeg_natural_order[k]] = (JCOEF) s;
+	} else {
+	  if (r != 15)
+	    break;
+	  k += 15;
+	}
+      }
+
+    } else {
+
+      /* Section F.2.2.2: decode the AC coefficients */
+      /* In this path we just discard the values */
+      for (k = 1; k < DCTSIZE2; k++) {
+	HUFF_DECODE(s, br_state, actbl, return FALSE, label3);
+      
+	r = s >> 4;
+	s &= 15;
+      
+	if (s) {
+	  k += r;
+	  CHECK_BIT_BUFFER(br_state, s, return FALSE);
+	  DROP_BITS(s);
+	} else {
+	  if (r != 15)
+	    break;
+	  k += 15;
+	}
+      }
+
+    }
+  }
+
+  /* Completed MCU, so update state */
+  BITREAD_SAVE_STATE(cinfo,entropy->bitstate);
+  ASSIGN_STATE(entropy->saved, state);
+  return TRUE;
+}
+
+
+/*
+ * Fast path for decoding one MCU, used when the source buffer holds enough
+ * bytes that we can't run off its end (see FAST_BYTES_PER_BLOCK) and no
+ * marker has been seen yet.  The bit buffer is refilled in bulk, without
+ * checking for suspension, and the combined lookahead tables decode the
+ * commonest codes and their values in one step.
+ *
+ * If we run into a marker we feed in zero bits to finish the MCU, then
+ * return FALSE so that decode_mcu throws the result away and decodes the
+ * MCU again with decode_mcu_slow, which deals with it properly.
+ */
+
+#define FAST_BYTES_PER_BLOCK  (DCTSIZE2 * 8)	/* worst case, with stuffing */
+
+/* Read one byte into get_buffer, checking for stuffing and markers */
+#define FAST_GET_BYTE  \
+	{ register int c0 = GETJOCTET(*buffer++);  \
+	  get_buffer = (get_buffer << 8) | c0;  \
+	  bits_left += 8;  \
+	  if (c0 == 0xFF) {  \
+	    register int c1 = GETJOCTET(*buffer++);  \
+	    if (c1 != 0) {  \
+	      cinfo->unread_marker = c1;  \
+	      buffer -= 2;  \
+	      get_buffer &= ~((bit_buf_type) 0xFF);  \
+	    } } }
+
+#if BIT_BUF_SIZE == 64
+
+/* Masks for the low six bytes of a bit_buf_type */
+#define FAST_ONES  ((((bit_buf_type) 0x0101) << 32) | 0x01010101)
+#define FAST_HIGHS  (FAST_ONES * 0x80)
+#define FAST_BYTES  (FAST_ONES * 0xFF)
+
+/* Ensure at least 48 bits are available; take six bytes at once
+ * unless one of them is 0xFF.
+ */
+#define FAST_FILL_BIT_BUFFER  \
+	if (bits_left <= 16) {  \
+	  register bit_buf_type word, test;  \
+	  word = ((bit_buf_type) GETJOCTET(buffer[0]) << 40) |  \
+		 ((bit_buf_type) GETJOCTET(buffer[1]) << 32) |  \
+		 ((bit_buf_type) GETJOCTET(buffer[2]) << 24) |  \
+		 ((bit_buf_type) GETJOCTET(buffer[3]) << 16) |  \
+		 ((bit_buf_type) GETJOCTET(buffer[4]) << 8) |  \
+		 (bit_buf_type) GETJOCTET(buffer[5]);  \
+	  test = ~word & FAST_BYTES;  \
+	  if (((test - FAST_ONES) & ~test & FAST_HIGHS) == 0) {  \
+	    get_buffer = (get_buffer << 48) | word;  \
+	    bits_left += 48;  \
+	    buffer += 6;  \
+	  } else {  \
+	    FAST_GET_BYTE FAST_GET_BYTE FAST_GET_BYTE  \
+	    FAST_GET_BYTE FAST_GET_BYTE FAST_GET_BYTE  \
+	  } }
+
+#else
+
+/* Ensure at least 16 bits are available */
+#define FAST_FILL_BIT_BUFFER  \
+	if (bits_left <= 16) {  \
+	  FAST_GET_BYTE FAST_GET_BYTE  \
+	}
+
+#endif
+
+/* Decode a Huffman code the ordinary way; there are always enough bits */
+#define FAST_HUFF_DECODE(result,htbl)  \
+	{ register int nb = htbl->look_nbits[PEEK_BITS(HUFF_LOOKAHEAD)];  \
+	  if (nb != 0) {  \
+	    result = htbl->look_sym[PEEK_BITS(HUFF_LOOKAHEAD)];  \
+	    DROP_BITS(nb);  \
+	  } else {  \
+	    register INT32 code;  \
+	    nb = HUFF_LOOKAHEAD+1;  \
+	    code = GET_BITS(nb);  \
+	    while (code > htbl->maxcode[nb]) {  \
+	      code = (code << 1) | GET_BITS(1);  \
+	      nb++;  \
+	    }  \
+	    if (nb > 16) {  \
+	      WARNMS(cinfo, JWRN_HUFF_BAD_CODE);  \
+	      result = 0;  \
+	    } else  \
+	      result = htbl->pub->huffval[(int) (code + htbl->valoffset[nb])];  \
+	  } }
+
+LOCAL(boolean)
+decode_mcu_fast (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  register bit_buf_type get_buffer;
+  register int bits_left;
+  register const JOCTET * buffer;
+  savable_state state;
+  int blkn;
+  SHIFT_TEMPS
+
+  /* Load up working state */
+  buffer = cinfo->src->next_input_byte;
+  get_buffer = entropy->bitstate.get_buffer;
+  bits_left = entropy->bitstate.bits_left;
+  ASSIGN_STATE(state, entropy->saved);
+
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
+    JBLOCKROW block = MCU_data[blkn];
+    d_derived_tbl * dctbl = entropy->dc_cur_tbls[blkn];
+    d_derived_tbl * actbl = entropy->ac_cur_tbls[blkn];
+    register int s, k, r;
+    register INT32 entry;
+
+    /* Section F.2.2.1: decode the DC coefficient difference */
+    FAST_FILL_BIT_BUFFER;
+    entry = dctbl->look_fast[PEEK_BITS(HUFF_FAST_BITS)];
+    if (entry != 0) {
+      DROP_BITS((int) (entry & 0xFF));
+      s = (int) RIGHT_SHIFT(entry, 16);
+    } else {
+      FAST_HUFF_DECODE(s, dctbl);
+      if (s) {
+	FAST_FILL_BIT_BUFFER;
+	r = GET_BITS(s);
+	s = HUFF_EXTEND(r, s);
+      }
+    }
+
+    if (entropy->dc_needed[blkn]) {
+      /* Convert DC difference to actual value, update last_dc_val */
+      int ci = cinfo->MCU_membership[blkn];
+      s += state.last_dc_val[ci];
+      state.last_dc_val[ci] = s;
+      (*block)[0] = (JCOEF) s;
+    }
+
+    if (entropy->ac_needed[blkn]) {
+
+      /* Section F.2.2.2: decode the AC coefficients */
+      for (k = 1; k < DCTSIZE2; k++) {
+	FAST_FILL_BIT_BUFFER;
+	entry = actbl->look_fast[PEEK_BITS(HUFF_FAST_BITS)];
+	if (entry != 0) {
+	  DROP_BITS((int) (entry & 0xFF));
+	  k += (int) ((entry >> 8) & 0xFF);
+	  (*block)[jpeg_natural_order[k]] = (JCOEF) RIGHT_SHIFT(entry, 16);
+	  continue;
+	}
+	FAST_HUFF_DECODE(s, actbl);
+
+	r = s >> 4;
+	s &= 15;
+
+	if (s) {
+	  k += r;
+	  FAST_FILL_BIT_BUFFER;
+	  r = GET_BITS(s);
+	  s = HUFF_EXTEND(r, s);
+	  (*block)[jpeg_natural_order[k]] = (JCOEF) s;
+	} else {
+	  if (r != 15)
+	    break;
+	  k += 15;
+	}
+      }
+
+    } else {
+
+      /* Section F.2.2.2: decode the AC coefficients and discard them */
+      for (k = 1; k < DCTSIZE2; k++) {
+	FAST_FILL_BIT_BUFFER;
+	entry = actbl->look_fast[PEEK_BITS(HUFF_FAST_BITS)];
+	if (entry != 0) {
+	  DROP_BITS((int) (entry & 0xFF));
+	  k += (int) ((entry >> 8) & 0xFF);
+	  continue;
+	}
+	FAST_HUFF_DECODE(s, actbl);
+
+	r = s >> 4;
+	s &= 15;
+
+	if (s) {
+	  k += r;
+	  FAST_FILL_BIT_BUFFER;
+	  DROP_BITS(s);
+	} else {
+	  if (r != 15)
+	    break;
+	  k += 15;
+	}
+      }
+
+    }
+  }
+
+  if (cinfo->unread_marker != 0) {
+    /* Hit a marker; let decode_mcu_slow do this MCU over */
+    cinfo->unread_marker = 0;
+    return FALSE;
+  }
+
+  /* Completed MCU, so update state */
+  cinfo->src->bytes_in_buffer -= (size_t) (buffer - cinfo->src->next_input_byte);
+  cinfo->src->next_input_byte = buffer;
+  entropy->bitstate.get_buffer = get_buffer;
+  entropy->bitstate.bits_left = bits_left;
+  ASSIGN_STATE(entropy->saved, state);
+  return TRUE;
+}
+
+
 /*
  * Decode and return one MCU's worth of Huffman-compressed coefficients.
  * The coefficients are reordered from zigzag order into natural array order,
@@ -517,9 +866,6 @@ METHODDEF(boolean)
 decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 {
   huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
-  int blkn;
-  BITREAD_STATE_VARS;
-  savable_state state;
 
   /* Process restart marker if needed; may have to suspend */
   if (cinfo->restart_interval) {
@@ -532,92 +878,13 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
    * This way, we return uniform gray for the remainder of the segment.
    */
   if (! entropy->pub.insufficient_data) {
-
-    /* Load up working state */
-    BITREAD_LOAD_STATE(cinfo,entropy->bitstate);
-    ASSIGN_STATE(state, entropy->saved);
-
-    /* Outer loop handles each block in the MCU */
-
-    for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
-      JBLOCKROW block = MCU_data[blkn];
-      d_derived_tbl * dctbl = entropy->dc_cur_tbls[blkn];
-      d_derived_tbl * actbl = entropy->ac_cur_tbls[blkn];
-      register int s, k, r;
-
-      /* Decode a single block's worth of coefficients */
-
-      /* Section F.2.2.1: decode the DC coefficient difference */
-      HUFF_DECODE(s, br_state, dctbl, return FALSE, label1);
-      if (s) {
-	CHECK_BIT_BUFFER(br_state, s, return FALSE);
-	r = GET_BITS(s);
-	s = HUFF_EXTEND(r, s);
-      }
-
-      if (entropy->dc_needed[blkn]) {
-	/* Convert DC difference to actual value, update last_dc_val */
-	int ci = cinfo->MCU_membership[blkn];
-	s += state.last_dc_val[ci];
-	state.last_dc_val[ci] = s;
-	/* Output the DC coefficient (assumes jpeg_natural_order[0] = 0) */
-	(*block)[0] = (JCOEF) s;
-      }
-
-      if (entropy->ac_needed[blkn]) {
-
-	/* Section F.2.2.2: decode the AC coefficients */
-	/* Since zeroes are skipped, output area must be cleared beforehand */
-	for (k = 1; k < DCTSIZE2; k++) {
-	  HUFF_DECODE(s, br_state, actbl, return FALSE, label2);
-      
-	  r = s >> 4;
-	  s &= 15;
-      
-	  if (s) {
-	    k += r;
-	    CHECK_BIT_BUFFER(br_state, s, return FALSE);
-	    r = GET_BITS(s);
-	    s = HUFF_EXTEND(r, s);
-	    /* Output coefficient in natural (dezigzagged) order.
-	     * Note: the extra entries in jpeg_natural_order[] will save us
-	     * if k >= DCTSIZE2, which could happen if the data is corrupted.
-	     */
-	    (*block)[jpeg_natural_order[k]] = (JCOEF) s;
-	  } else {
-	    if (r != 15)
-	      break;
-	    k += 15;
-	  }
-	}
-
-      } else {
-
-	/* Section F.2.2.2: decode the AC coefficients */
-	/* In this path we just discard the values */
-	for (k = 1; k < DCTSIZE2; k++) {
-	  HUFF_DECODE(s, br_state, actbl, return FALSE, label3);
-      
-	  r = s >> 4;
-	  s &= 15;
-      
-	  if (s) {
-	    k += r;
-	    CHECK_BIT_BUFFER(br_state, s, return FALSE);
-	    DROP_BITS(s);
-	  } else {
-	    if (r != 15)
-	      break;
-	    k += 15;
-	  }
-	}
-
-      }
+    if (cinfo->unread_marker != 0 ||
+	cinfo->src->bytes_in_buffer <
+	(size_t) (FAST_BYTES_PER_BLOCK * cinfo->blocks_in_MCU) ||
+	! decode_mcu_fast(cinfo, MCU_data)) {
+      if (! decode_mcu_slow(cinfo, MCU_data))
+	return FALSE;
     }
-
-    /* Completed MCU, so update state */
-    BITREAD_SAVE_STATE(cinfo,entropy->bitstate);
-    ASSIGN_STATE(entropy->saved, state);
   }
 
   /* Account for restart interval (no-op if not using restarts) */
@@ -22,6 +22,7 @@
 /* Derived data constructed for each Huffman table */
 
 #define HUFF_LOOKAHEAD	8	/* # of bits of lookahead */
+#define HUFF_FAST_BITS	10	/* # of bits of combined lookahead */
 
 typedef struct {
   /* Basic tables: (element [0] of each array is unused) */
@@ -43,6 +44,15 @@ typedef struct {
    */
   int look_nbits[1<<HUFF_LOOKAHEAD]; /* # bits, or 0 if too long */
   UINT8 look_sym[1<<HUFF_LOOKAHEAD]; /* symbol, or unused */
+
+  /* Combined lookahead table for the sequential decoder's fast path:
+   * indexed by the next HUFF_FAST_BITS bits, it holds (value << 16) |
+   * (run << 8) | (total # bits) for each code whose length plus the
+   * length of its following value bits fits in HUFF_FAST_BITS.  The
+   * value has already been through HUFF_EXTEND.  A zero entry means the
+   * code must be decoded the ordinary way (including AC EOB and ZRL codes).
+   */
+  INT32 look_fast[1<<HUFF_FAST_BITS];
 } d_derived_tbl;
 
 /* Expand a Huffman table definition into the derived format */
@@ -69,13 +79,19 @@ EXTERN(void) jpeg_make_d_derived_tbl
  * necessary.
  */
 
+#if !defined(SLOW_SHIFT_32) && \
+    (defined(_WIN64) || defined(_LP64) || defined(__LP64__))
+typedef size_t bit_buf_type;	/* type of bit-extraction buffer */
+#define BIT_BUF_SIZE  64	/* size of buffer in bits */
+#else
 typedef INT32 bit_buf_type;	/* type of bit-extraction buffer */
 #define BIT_BUF_SIZE  32	/* size of buffer in bits */
+#endif
 
-/* If long is > 32 bits on your machine, and shifting/masking longs is
- * reasonably fast, making bit_buf_type be long and setting BIT_BUF_SIZE
- * appropriately should be a win.  Unfortunately we can't define the size
- * with something like  #define BIT_BUF_SIZE (sizeof(bit_buf_type)*8)
+/* On 64-bit machines, where shifting and masking a size_t is as fast as
+ * an int, we use a 64-bit buffer; this roughly halves the number of
+ * refills.  Unfortunately we can't define the size with something like
+ *  #define BIT_BUF_SIZE (sizeof(bit_buf_type)*8)
  * because not all machines measure sizeof in 8-bit bytes.
  */
 
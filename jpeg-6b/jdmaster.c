@@ -35,6 +35,30 @@ typedef struct {
 typedef my_decomp_master * my_master_ptr;
 
 
+/*
+ * Zebaoth-specific extension: the hicolor output spaces are only
+ * produced by the merged upsampler in jdmerge.c.
+ */
+
+LOCAL(boolean)
+use_merged_hicolor (j_decompress_ptr cinfo)
+{
+  return (cinfo->out_color_space == JCS_RGB16_555 || 
+	  cinfo->out_color_space == JCS_BGR16_555 || 
+	  cinfo->out_color_space == JCS_RGB16_565 ||
+	  cinfo->out_color_space == JCS_RGB16_555_DBL || 
+	  cinfo->out_color_space == JCS_BGR16_555_DBL || 
+	  cinfo->out_color_space == JCS_RGB16_565_DBL ||
+	  cinfo->out_color_space == JCS_RGB_DBL ||
+	  cinfo->out_color_space == JCS_BGR_DBL ||
+	  cinfo->out_color_space == JCS_BGR ||
+	  cinfo->out_color_space == JCS_XRGB32 ||
+	  cinfo->out_color_space == JCS_XBGR32 ||
+	  cinfo->out_color_space == JCS_XRGB32_DBL ||
+	  cinfo->out_color_space == JCS_XBGR32_DBL);
+}
+
+
 /*
  * Determine whether merged upsample/color conversion should be used.
  * CRUCIAL: this must match the actual capabilities of jdmerge.c!
@@ -44,15 +68,7 @@ LOCAL(boolean)
 use_merged_upsample (j_decompress_ptr cinfo)
 {
 #ifdef UPSAMPLE_MERGING_SUPPORTED
-  if (cinfo->out_color_space == JCS_RGB16_555 || 
-      cinfo->out_color_space == JCS_BGR16_555 || 
-      cinfo->out_color_space == JCS_RGB16_565 ||
-      cinfo->out_color_space == JCS_RGB16_555_DBL || 
-      cinfo->out_color_space == JCS_BGR16_555_DBL || 
-      cinfo->out_color_space == JCS_RGB16_565_DBL ||
-      cinfo->out_color_space == JCS_RGB_DBL ||
-      cinfo->out_color_space == JCS_BGR_DBL ||
-      cinfo->out_color_space == JCS_BGR) return TRUE;
+  if (use_merged_hicolor(cinfo)) return TRUE;
   /* Merging is the equivalent of plain box-filter upsampling */
   if (cinfo->do_fancy_upsampling || cinfo->CCIR601_sampling)
     return FALSE;
@@ -136,11 +152,15 @@ jpeg_calc_output_dimensions (j_decompress_ptr cinfo)
    * scale up the chroma components via IDCT scaling rather than upsampling.
    * This saves time if the upsampler gets to use 1:1 scaling.
    * Note this code assumes that the supported DCT scalings are powers of 2.
+   * The merged hicolor upsampler can't do that: it needs every component
+   * scaled alike, as it always upsamples the chroma itself.  Nor is it
+   * wanted for raw data output, which keeps each component's sampling.
    */
   for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components;
        ci++, compptr++) {
     int ssize = cinfo->min_DCT_scaled_size;
-    while (ssize < DCTSIZE &&
+    while (ssize < DCTSIZE && ! use_merged_hicolor(cinfo) &&
+	   ! cinfo->raw_data_out &&
 	   (compptr->h_samp_factor * ssize * 2 <=
 	    cinfo->max_h_samp_factor * cinfo->min_DCT_scaled_size) &&
 	   (compptr->v_samp_factor * ssize * 2 <=
@@ -188,6 +208,10 @@ jpeg_calc_output_dimensions (j_decompress_ptr cinfo)
   case JCS_RGB16_565:
   case JCS_RGB16_555_DBL:
   case JCS_RGB16_565_DBL:
+  case JCS_XRGB32:
+  case JCS_XBGR32:
+  case JCS_XRGB32_DBL:
+  case JCS_XBGR32_DBL:
     cinfo->out_color_components = 3;
     break;
   case JCS_RGB:
@@ -35,6 +35,7 @@
 #define JPEG_INTERNALS
 #include "jinclude.h"
 #include "jpeglib.h"
+#include "jsimd.h"
 
 #ifdef UPSAMPLE_MERGING_SUPPORTED
 
@@ -62,6 +63,16 @@ typedef struct {
   const int * Cb_g_tab;		/* => table for Cb to G conversion */
 #endif
 
+  /* Private state for hicolor output: each table maps an 8-bit sample to
+   * its bits of a 16-bit pixel, repeated in both halves of the word, or
+   * to its bits of a 32-bit pixel (the R table also sets the X byte).
+   * They belong to this decompressor, so decoders with different pixel
+   * layouts can run at the same time.
+   */
+  unsigned int * hicolor_r;	/* => table for R to hicolor bits */
+  unsigned int * hicolor_g;	/* => table for G to hicolor bits */
+  unsigned int * hicolor_b;	/* => table for B to hicolor bits */
+
   /* For 2:1 vertical sampling, we produce two output rows at a time.
    * We need a "spare" row buffer to hold the second output row if the
    * application provides just a one-row buffer; we also use the spare
@@ -71,7 +82,12 @@ typedef struct {
   boolean spare_full;		/* T if spare buffer is occupied */
 
   JDIMENSION out_row_width;	/* samples per output row */
+  long dbl_offset;		/* bytes to the copy of each _DBL row, or 0 */
   JDIMENSION rows_to_go;	/* counts rows remaining in image */
+
+#ifdef JSIMD_SUPPORTED
+  int simd_format;		/* hicolor format for jsimd, 0 if none */
+#endif
 } my_upsampler;
 
 typedef my_upsampler * my_upsample_ptr;
@@ -80,11 +96,6 @@ typedef my_upsampler * my_upsample_ptr;
 #define ONE_HALF	((INT32) 1 << (SCALEBITS-1))
 #define FIX(x)		((INT32) ((x) * (1L<<SCALEBITS) + 0.5))
 
-/* zebaoth specific */
-unsigned int hicolor_r[256];
-unsigned int hicolor_g[256];
-unsigned int hicolor_b[256];
-
 /* These tables are precalculated translation table values */
 static const int gCr_r_tab[] = {
 -179, -178, -177, -175, -174, -172, -171, -170, -168, -167, -165, -164, -163, -161, -160, -158, -157, -156, -154, -153, -151, -150, -149, -147, -146, -144, -143, -142, -140, -139, -137, -136, -135, -133, -132, -130, -129, -128, -126, -125, -123, -122, -121, -119, -118, -116, -115, -114, -112, -111, -109, -108, -107, -105, -104, -102, -101, -100, -98, -97, -95, -94, -93, -91, -90, -88, -87, -86, -84, -83, -81, -80, -79, -77, -76, -74, -73, -72, -70, -69, -67, -66, -64, -63, -62, -60, -59, -57, -56, -55, -53, -52, -50, -49, -48, -46, -45, -43, -42, -41, -39, -38, -36, -35, -34, -32, -31, -29, -28, -27, -25, -24, -22, -21, -20, -18, -17, -15, -14, -13, -11, -10, -8, -7, -6, -4, -3, -1, 0, 1, 3, 4, 6, 7, 8, 10, 11, 13, 14, 15, 17, 18, 20, 21, 22, 24, 25, 27, 28, 29, 31, 32, 34, 35, 36, 38, 39, 41, 42, 43, 45, 46, 48, 49, 50, 52, 53, 55, 56, 57, 59, 60, 62, 63, 64, 66, 67, 69, 70, 72, 73, 74, 76, 77, 79, 80, 81, 83, 84, 86, 87, 88, 90, 91, 93, 94, 95, 97, 98, 100, 101, 102, 104, 105, 107, 108, 109, 111, 112, 114, 115, 116, 118, 119, 121, 122, 123, 125, 126, 128, 129, 130, 132, 133, 135, 136, 137, 139, 140, 142, 143, 144, 146, 147, 149, 150, 151, 153, 154, 156, 157, 158, 160, 161, 163, 164, 165, 167, 168, 170, 171, 172, 174, 175, 177, 178, 
@@ -108,6 +119,9 @@ LOCAL(void)
 build_ycc_rgb_table (j_decompress_ptr cinfo)
 {
   my_upsample_ptr upsample = (my_upsample_ptr) cinfo->upsample;
+  unsigned int * hicolor_r;
+  unsigned int * hicolor_g;
+  unsigned int * hicolor_b;
   int i;
 #ifdef CALCULATE_TABLES
   INT32 x;
@@ -179,6 +193,44 @@ exit(0);
 #endif /* CALCULATE_TABLES */
   
   /* hicolor Zebaoth specific: */
+  upsample->hicolor_r = upsample->hicolor_g = upsample->hicolor_b = NULL;
+  switch (cinfo->out_color_space) {
+  case JCS_RGB16_555: case JCS_RGB16_555_DBL:
+  case JCS_BGR16_555: case JCS_BGR16_555_DBL:
+  case JCS_RGB16_565: case JCS_RGB16_565_DBL:
+  case JCS_BGR: case JCS_RGB_DBL: case JCS_BGR_DBL:
+  case JCS_XRGB32: case JCS_XRGB32_DBL:
+  case JCS_XBGR32: case JCS_XBGR32_DBL:
+    break;
+  default:
+    return;			/* no hicolor output */
+  }
+  hicolor_r = (unsigned int *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				3 * 256 * SIZEOF(unsigned int));
+  hicolor_g = hicolor_r + 256;
+  hicolor_b = hicolor_g + 256;
+  upsample->hicolor_r = hicolor_r;
+  upsample->hicolor_g = hicolor_g;
+  upsample->hicolor_b = hicolor_b;
+
+  if (cinfo->out_color_space == JCS_XRGB32 || cinfo->out_color_space == JCS_XRGB32_DBL) {
+    for (i = 0; i < 256; i++) {
+      hicolor_r[i] = 0xFF000000 | (i << 16);
+      hicolor_g[i] = i << 8;
+      hicolor_b[i] = i;
+    }
+    return;			/* 32-bit pixels fill the whole word */
+  }
+  if (cinfo->out_color_space == JCS_XBGR32 || cinfo->out_color_space == JCS_XBGR32_DBL) {
+    for (i = 0; i < 256; i++) {
+      hicolor_r[i] = 0xFF000000 | i;
+      hicolor_g[i] = i << 8;
+      hicolor_b[i] = i << 16;
+    }
+    return;
+  }
+
   if (cinfo->out_color_space == JCS_RGB16_555 || cinfo->out_color_space == JCS_RGB16_555_DBL)
     for (i = 0; i < 256; i++) {
       hicolor_r[i] = (i >> 3) << 10;
@@ -191,7 +243,7 @@ exit(0);
       hicolor_g[i] = (i >> 3) << 5;
       hicolor_b[i] = (i >> 3) << 10;
     }
-  else if (cinfo->out_color_space == JCS_RGB16_565 || cinfo->out_color_space == JCS_RGB16_565_DBL)
+  else
     for (i = 0; i < 256; i++) {
       hicolor_r[i] = (i >> 3) << 11;
       hicolor_g[i] = (i >> 2) << 5;
@@ -245,6 +297,11 @@ merged_2v_upsample (j_decompress_ptr cinfo,
     /* If we have a spare row saved from a previous cycle, just return it. */
     jcopy_sample_rows(& upsample->spare_row, 0, output_buf + *out_row_ctr, 0,
 		      1, upsample->out_row_width);
+    if (upsample->dbl_offset) {
+      JSAMPROW dup_row = output_buf[*out_row_ctr] + upsample->dbl_offset;
+      jcopy_sample_rows(& upsample->spare_row, 0, & dup_row, 0,
+			1, upsample->out_row_width);
+    }
     num_rows = 1;
     upsample->spare_full = FALSE;
   } else {
@@ -469,6 +526,9 @@ h2v2_merged_upsample_hicolor (j_decompress_ptr cinfo,
   const int * Cbbtab = upsample->Cb_b_tab;
   const int * Crgtab = upsample->Cr_g_tab;
   const int * Cbgtab = upsample->Cb_g_tab;
+  const unsigned int * hicolor_r = upsample->hicolor_r;
+  const unsigned int * hicolor_g = upsample->hicolor_g;
+  const unsigned int * hicolor_b = upsample->hicolor_b;
   SHIFT_TEMPS
 
   inptr00 = input_buf[0][in_row_group_ctr*2];
@@ -477,8 +537,25 @@ h2v2_merged_upsample_hicolor (j_decompress_ptr cinfo,
   inptr2 = input_buf[2][in_row_group_ctr];
   outptr0 = (unsigned short*) output_buf[0];
   outptr1 = (unsigned short*) output_buf[1];
+  col = cinfo->output_width >> 1;
+#ifdef JSIMD_SUPPORTED
+  /* Let the vector code do what it can, and finish the row here */
+  if (upsample->simd_format) {
+    JDIMENSION done;
+    done = jsimd_h2v2_merged_hicolor(upsample->simd_format, FALSE, col,
+				     inptr00, inptr01, inptr1, inptr2,
+				     output_buf[0], output_buf[1], 0L, 0L);
+    inptr00 += 2*done;
+    inptr01 += 2*done;
+    inptr1 += done;
+    inptr2 += done;
+    outptr0 += 2*done;
+    outptr1 += 2*done;
+    col -= done;
+  }
+#endif
   /* Loop for each group of output pixels */
-  for (col = cinfo->output_width >> 1; col > 0; col--) {
+  for (; col > 0; col--) {
     /* Do the chroma part of the calculation */
     cb = GETJSAMPLE(*inptr1++);
     cr = GETJSAMPLE(*inptr2++);
@@ -507,6 +584,22 @@ h2v2_merged_upsample_hicolor (j_decompress_ptr cinfo,
                hicolor_b[range_limit[y + cblue]]; 
     outptr1++;
   }
+  /* If image width is odd, do the last output column separately */
+  if (cinfo->output_width & 1) {
+    cb = GETJSAMPLE(*inptr1);
+    cr = GETJSAMPLE(*inptr2);
+    cred = Crrtab[cr];
+    cgreen = (int) RIGHT_SHIFT(Cbgtab[cb] + Crgtab[cr], SCALEBITS);
+    cblue = Cbbtab[cb];
+    y  = GETJSAMPLE(*inptr00);
+    *outptr0 = hicolor_r[range_limit[y + cred]] |
+               hicolor_g[range_limit[y + cgreen]] |
+               hicolor_b[range_limit[y + cblue]];
+    y  = GETJSAMPLE(*inptr01);
+    *outptr1 = hicolor_r[range_limit[y + cred]] |
+               hicolor_g[range_limit[y + cgreen]] |
+               hicolor_b[range_limit[y + cblue]];
+  }
 }
 
 
@@ -515,12 +608,114 @@ h2v2_merged_upsample_hicolor (j_decompress_ptr cinfo,
 
 
 
-/* For hicolor double pixels (2x1) */
+/* For hicolor double pixels (2x1, or 2x2 with a dbl_row_offset) */
 
 METHODDEF(void)
 h2v2_merged_upsample_hicolor_dbl (j_decompress_ptr cinfo,
 		      JSAMPIMAGE input_buf, JDIMENSION in_row_group_ctr,
 		      JSAMPARRAY output_buf)
+{
+  my_upsample_ptr upsample = (my_upsample_ptr) cinfo->upsample;
+  register int y, cred, cgreen, cblue;
+  int cb, cr;
+  register unsigned int *outptr0, *outptr1;
+  register unsigned int *dupptr0, *dupptr1;
+  long dup0, dup1;
+  JSAMPROW inptr00, inptr01, inptr1, inptr2;
+  JDIMENSION col;
+  /* copy these pointers into registers if possible */
+  register JSAMPLE * range_limit = cinfo->sample_range_limit;
+  const int * Crrtab = upsample->Cr_r_tab;
+  const int * Cbbtab = upsample->Cb_b_tab;
+  const int * Crgtab = upsample->Cr_g_tab;
+  const int * Cbgtab = upsample->Cb_g_tab;
+  const unsigned int * hicolor_r = upsample->hicolor_r;
+  const unsigned int * hicolor_g = upsample->hicolor_g;
+  const unsigned int * hicolor_b = upsample->hicolor_b;
+  SHIFT_TEMPS
+
+  inptr00 = input_buf[0][in_row_group_ctr*2];
+  inptr01 = input_buf[0][in_row_group_ctr*2 + 1];
+  inptr1 = input_buf[1][in_row_group_ctr];
+  inptr2 = input_buf[2][in_row_group_ctr];
+  outptr0 = (unsigned int*) output_buf[0];
+  outptr1 = (unsigned int*) output_buf[1];
+  /* Store each row to its copy too, unless it's going to the spare row */
+  dup0 = upsample->dbl_offset;
+  dup1 = (output_buf[1] == upsample->spare_row) ? 0 : dup0;
+  dupptr0 = (unsigned int*) (output_buf[0] + dup0);
+  dupptr1 = (unsigned int*) (output_buf[1] + dup1);
+  col = cinfo->output_width >> 1;
+#ifdef JSIMD_SUPPORTED
+  /* Let the vector code do what it can, and finish the row here */
+  if (upsample->simd_format) {
+    JDIMENSION done;
+    done = jsimd_h2v2_merged_hicolor(upsample->simd_format, TRUE, col,
+				     inptr00, inptr01, inptr1, inptr2,
+				     output_buf[0], output_buf[1],
+				     dup0, dup1);
+    inptr00 += 2*done;
+    inptr01 += 2*done;
+    inptr1 += done;
+    inptr2 += done;
+    outptr0 += 2*done;
+    outptr1 += 2*done;
+    dupptr0 += 2*done;
+    dupptr1 += 2*done;
+    col -= done;
+  }
+#endif
+  /* Loop for each group of output pixels */
+  for (; col > 0; col--) {
+    /* Do the chroma part of the calculation */
+    cb = GETJSAMPLE(*inptr1++);
+    cr = GETJSAMPLE(*inptr2++);
+    cred = Crrtab[cr];
+    cgreen = (int) RIGHT_SHIFT(Cbgtab[cb] + Crgtab[cr], SCALEBITS);
+    cblue = Cbbtab[cb];
+    /* Fetch 4 Y values and emit 4 pixels */
+    y  = GETJSAMPLE(*inptr00++);
+    *outptr0++ = *dupptr0++ = hicolor_r[range_limit[y + cred]] |
+                              hicolor_g[range_limit[y + cgreen]] |
+                              hicolor_b[range_limit[y + cblue]];
+    y  = GETJSAMPLE(*inptr00++);
+    *outptr0++ = *dupptr0++ = hicolor_r[range_limit[y + cred]] |
+                              hicolor_g[range_limit[y + cgreen]] |
+                              hicolor_b[range_limit[y + cblue]];
+    y  = GETJSAMPLE(*inptr01++);
+    *outptr1++ = *dupptr1++ = hicolor_r[range_limit[y + cred]] |
+                              hicolor_g[range_limit[y + cgreen]] |
+                              hicolor_b[range_limit[y + cblue]];
+    y  = GETJSAMPLE(*inptr01++);
+    *outptr1++ = *dupptr1++ = hicolor_r[range_limit[y + cred]] |
+                              hicolor_g[range_limit[y + cgreen]] |
+                              hicolor_b[range_limit[y + cblue]];
+  }
+  /* If image width is odd, do the last output column separately */
+  if (cinfo->output_width & 1) {
+    cb = GETJSAMPLE(*inptr1);
+    cr = GETJSAMPLE(*inptr2);
+    cred = Crrtab[cr];
+    cgreen = (int) RIGHT_SHIFT(Cbgtab[cb] + Crgtab[cr], SCALEBITS);
+    cblue = Cbbtab[cb];
+    y  = GETJSAMPLE(*inptr00);
+    *outptr0 = *dupptr0 = hicolor_r[range_limit[y + cred]] |
+                           hicolor_g[range_limit[y + cgreen]] |
+                           hicolor_b[range_limit[y + cblue]];
+    y  = GETJSAMPLE(*inptr01);
+    *outptr1 = *dupptr1 = hicolor_r[range_limit[y + cred]] |
+                           hicolor_g[range_limit[y + cgreen]] |
+                           hicolor_b[range_limit[y + cblue]];
+  }
+}
+
+
+/* For 32-bit XRGB or XBGR pixels */
+
+METHODDEF(void)
+h2v2_merged_upsample_rgb32 (j_decompress_ptr cinfo,
+		      JSAMPIMAGE input_buf, JDIMENSION in_row_group_ctr,
+		      JSAMPARRAY output_buf)
 {
   my_upsample_ptr upsample = (my_upsample_ptr) cinfo->upsample;
   register int y, cred, cgreen, cblue;
@@ -534,6 +729,9 @@ h2v2_merged_upsample_hicolor_dbl (j_decompress_ptr cinfo,
   const int * Cbbtab = upsample->Cb_b_tab;
   const int * Crgtab = upsample->Cr_g_tab;
   const int * Cbgtab = upsample->Cb_g_tab;
+  const unsigned int * hicolor_r = upsample->hicolor_r;
+  const unsigned int * hicolor_g = upsample->hicolor_g;
+  const unsigned int * hicolor_b = upsample->hicolor_b;
   SHIFT_TEMPS
 
   inptr00 = input_buf[0][in_row_group_ctr*2];
@@ -552,25 +750,130 @@ h2v2_merged_upsample_hicolor_dbl (j_decompress_ptr cinfo,
     cblue = Cbbtab[cb];
     /* Fetch 4 Y values and emit 4 pixels */
     y  = GETJSAMPLE(*inptr00++);
-    *outptr0 = hicolor_r[range_limit[y + cred]] |
-               hicolor_g[range_limit[y + cgreen]] | 	      
-               hicolor_b[range_limit[y + cblue]]; 
-    outptr0++;
+    outptr0[0] = hicolor_r[range_limit[y + cred]] |
+                 hicolor_g[range_limit[y + cgreen]] |
+                 hicolor_b[range_limit[y + cblue]];
     y  = GETJSAMPLE(*inptr00++);
-    *outptr0 = hicolor_r[range_limit[y + cred]] |
-               hicolor_g[range_limit[y + cgreen]] | 	      
-               hicolor_b[range_limit[y + cblue]]; 
-    outptr0++;
+    outptr0[1] = hicolor_r[range_limit[y + cred]] |
+                 hicolor_g[range_limit[y + cgreen]] |
+                 hicolor_b[range_limit[y + cblue]];
+    outptr0 += 2;
     y  = GETJSAMPLE(*inptr01++);
-    *outptr1 = hicolor_r[range_limit[y + cred]] |
-               hicolor_g[range_limit[y + cgreen]] | 	      
-               hicolor_b[range_limit[y + cblue]]; 
-    outptr1++;
+    outptr1[0] = hicolor_r[range_limit[y + cred]] |
+                 hicolor_g[range_limit[y + cgreen]] |
+                 hicolor_b[range_limit[y + cblue]];
     y  = GETJSAMPLE(*inptr01++);
+    outptr1[1] = hicolor_r[range_limit[y + cred]] |
+                 hicolor_g[range_limit[y + cgreen]] |
+                 hicolor_b[range_limit[y + cblue]];
+    outptr1 += 2;
+  }
+  /* If image width is odd, do the last output column separately */
+  if (cinfo->output_width & 1) {
+    cb = GETJSAMPLE(*inptr1);
+    cr = GETJSAMPLE(*inptr2);
+    cred = Crrtab[cr];
+    cgreen = (int) RIGHT_SHIFT(Cbgtab[cb] + Crgtab[cr], SCALEBITS);
+    cblue = Cbbtab[cb];
+    y  = GETJSAMPLE(*inptr00);
+    *outptr0 = hicolor_r[range_limit[y + cred]] |
+               hicolor_g[range_limit[y + cgreen]] |
+               hicolor_b[range_limit[y + cblue]];
+    y  = GETJSAMPLE(*inptr01);
     *outptr1 = hicolor_r[range_limit[y + cred]] |
-               hicolor_g[range_limit[y + cgreen]] | 	      
-               hicolor_b[range_limit[y + cblue]]; 
-    outptr1++;
+               hicolor_g[range_limit[y + cgreen]] |
+               hicolor_b[range_limit[y + cblue]];
+  }
+}
+
+
+/* For 32-bit double pixels (2x1, or 2x2 with a dbl_row_offset) */
+
+METHODDEF(void)
+h2v2_merged_upsample_rgb32_dbl (j_decompress_ptr cinfo,
+		      JSAMPIMAGE input_buf, JDIMENSION in_row_group_ctr,
+		      JSAMPARRAY output_buf)
+{
+  my_upsample_ptr upsample = (my_upsample_ptr) cinfo->upsample;
+  register int y, cred, cgreen, cblue;
+  register unsigned int pixel;
+  int cb, cr;
+  register unsigned int *outptr0, *outptr1;
+  register unsigned int *dupptr0, *dupptr1;
+  JSAMPROW inptr00, inptr01, inptr1, inptr2;
+  JDIMENSION col;
+  /* copy these pointers into registers if possible */
+  register JSAMPLE * range_limit = cinfo->sample_range_limit;
+  const int * Crrtab = upsample->Cr_r_tab;
+  const int * Cbbtab = upsample->Cb_b_tab;
+  const int * Crgtab = upsample->Cr_g_tab;
+  const int * Cbgtab = upsample->Cb_g_tab;
+  const unsigned int * hicolor_r = upsample->hicolor_r;
+  const unsigned int * hicolor_g = upsample->hicolor_g;
+  const unsigned int * hicolor_b = upsample->hicolor_b;
+  SHIFT_TEMPS
+
+  inptr00 = input_buf[0][in_row_group_ctr*2];
+  inptr01 = input_buf[0][in_row_group_ctr*2 + 1];
+  inptr1 = input_buf[1][in_row_group_ctr];
+  inptr2 = input_buf[2][in_row_group_ctr];
+  outptr0 = (unsigned int*) output_buf[0];
+  outptr1 = (unsigned int*) output_buf[1];
+  /* Store each row to its copy too, unless it's going to the spare row */
+  dupptr0 = (unsigned int*) (output_buf[0] + upsample->dbl_offset);
+  dupptr1 = (output_buf[1] == upsample->spare_row) ? outptr1 :
+	    (unsigned int*) (output_buf[1] + upsample->dbl_offset);
+  /* Loop for each group of output pixels */
+  for (col = cinfo->output_width >> 1; col > 0; col--) {
+    /* Do the chroma part of the calculation */
+    cb = GETJSAMPLE(*inptr1++);
+    cr = GETJSAMPLE(*inptr2++);
+    cred = Crrtab[cr];
+    cgreen = (int) RIGHT_SHIFT(Cbgtab[cb] + Crgtab[cr], SCALEBITS);
+    cblue = Cbbtab[cb];
+    /* Fetch 4 Y values and emit 8 pixels */
+    y  = GETJSAMPLE(*inptr00++);
+    pixel = hicolor_r[range_limit[y + cred]] |
+            hicolor_g[range_limit[y + cgreen]] |
+            hicolor_b[range_limit[y + cblue]];
+    outptr0[0] = outptr0[1] = dupptr0[0] = dupptr0[1] = pixel;
+    y  = GETJSAMPLE(*inptr00++);
+    pixel = hicolor_r[range_limit[y + cred]] |
+            hicolor_g[range_limit[y + cgreen]] |
+            hicolor_b[range_limit[y + cblue]];
+    outptr0[2] = outptr0[3] = dupptr0[2] = dupptr0[3] = pixel;
+    outptr0 += 4;
+    dupptr0 += 4;
+    y  = GETJSAMPLE(*inptr01++);
+    pixel = hicolor_r[range_limit[y + cred]] |
+            hicolor_g[range_limit[y + cgreen]] |
+            hicolor_b[range_limit[y + cblue]];
+    outptr1[0] = outptr1[1] = dupptr1[0] = dupptr1[1] = pixel;
+    y  = GETJSAMPLE(*inptr01++);
+    pixel = hicolor_r[range_limit[y + cred]] |
+            hicolor_g[range_limit[y + cgreen]] |
+            hicolor_b[range_limit[y + cblue]];
+    outptr1[2] = outptr1[3] = dupptr1[2] = dupptr1[3] = pixel;
+    outptr1 += 4;
+    dupptr1 += 4;
+  }
+  /* If image width is odd, do the last output column separately */
+  if (cinfo->output_width & 1) {
+    cb = GETJSAMPLE(*inptr1);
+    cr = GETJSAMPLE(*inptr2);
+    cred = Crrtab[cr];
+    cgreen = (int) RIGHT_SHIFT(Cbgtab[cb] + Crgtab[cr], SCALEBITS);
+    cblue = Cbbtab[cb];
+    y  = GETJSAMPLE(*inptr00);
+    pixel = hicolor_r[range_limit[y + cred]] |
+            hicolor_g[range_limit[y + cgreen]] |
+            hicolor_b[range_limit[y + cblue]];
+    outptr0[0] = outptr0[1] = dupptr0[0] = dupptr0[1] = pixel;
+    y  = GETJSAMPLE(*inptr01);
+    pixel = hicolor_r[range_limit[y + cred]] |
+            hicolor_g[range_limit[y + cgreen]] |
+            hicolor_b[range_limit[y + cblue]];
+    outptr1[0] = outptr1[1] = dupptr1[0] = dupptr1[1] = pixel;
   }
 }
 
@@ -602,6 +905,7 @@ jinit_merged_upsampler (j_decompress_ptr cinfo)
   upsample->pub.need_context_rows = FALSE;
 
   upsample->out_row_width = cinfo->output_width * cinfo->out_color_components;
+  upsample->dbl_offset = 0;
 
   if (cinfo->max_v_samp_factor == 2) {
     upsample->pub.upsample = merged_2v_upsample;
@@ -612,6 +916,7 @@ jinit_merged_upsampler (j_decompress_ptr cinfo)
       case JCS_RGB16_565:
       case JCS_BGR:
         upsample->upmethod = h2v2_merged_upsample_hicolor;
+        upsample->out_row_width = cinfo->output_width * SIZEOF(unsigned short);
    	    break;
       case JCS_RGB16_555_DBL:
       case JCS_BGR16_555_DBL:
@@ -619,7 +924,20 @@ jinit_merged_upsampler (j_decompress_ptr cinfo)
       case JCS_RGB_DBL:
       case JCS_BGR_DBL:
         upsample->upmethod = h2v2_merged_upsample_hicolor_dbl;
+        upsample->out_row_width = cinfo->output_width * SIZEOF(unsigned int);
+        upsample->dbl_offset = cinfo->dbl_row_offset;
    	    break;
+      case JCS_XRGB32:
+      case JCS_XBGR32:
+        upsample->upmethod = h2v2_merged_upsample_rgb32;
+        upsample->out_row_width = cinfo->output_width * SIZEOF(unsigned int);
+        break;
+      case JCS_XRGB32_DBL:
+      case JCS_XBGR32_DBL:
+        upsample->upmethod = h2v2_merged_upsample_rgb32_dbl;
+        upsample->out_row_width = cinfo->output_width * 2 * SIZEOF(unsigned int);
+        upsample->dbl_offset = cinfo->dbl_row_offset;
+        break;
       default:
         upsample->upmethod = h2v2_merged_upsample;
     }
@@ -635,6 +953,31 @@ jinit_merged_upsampler (j_decompress_ptr cinfo)
   }
 
   build_ycc_rgb_table(cinfo);
+
+#ifdef JSIMD_SUPPORTED
+  /* Vectorized hicolor conversion, if this CPU can do it */
+  upsample->simd_format = 0;
+  if ((upsample->upmethod == h2v2_merged_upsample_hicolor ||
+       upsample->upmethod == h2v2_merged_upsample_hicolor_dbl) &&
+      jsimd_cpu_support()) {
+    switch (cinfo->out_color_space) {
+      case JCS_RGB16_565:
+      case JCS_RGB16_565_DBL:
+        upsample->simd_format = JSIMD_RGB565;
+        break;
+      case JCS_RGB16_555:
+      case JCS_RGB16_555_DBL:
+        upsample->simd_format = JSIMD_RGB555;
+        break;
+      case JCS_BGR16_555:
+      case JCS_BGR16_555_DBL:
+        upsample->simd_format = JSIMD_BGR555;
+        break;
+      default:
+        break;
+    }
+  }
+#endif
 }
 
 #endif /* UPSAMPLE_MERGING_SUPPORTED */
@@ -0,0 +1,354 @@
+/*
+ * jdmrgvec.c
+ *
+ * This file is part of the SMJPEG modifications to the Independent JPEG
+ * Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains vectorized versions of the merged h2v2 upsampling and
+ * color conversion to hicolor (5-6-5 and 5-5-5) pixels in jdmerge.c.
+ * Read that file first.
+ *
+ * The table lookups of jdmerge.c are replaced by the same fixed point
+ * arithmetic done on 16-bit lanes.  With x = Cb or Cr - CENTERJSAMPLE,
+ *	Cr_r_tab[cr] = (91881 * x + ONE_HALF) >> 16
+ *	             = x + ((26345 * x + 32768) >> 16)
+ *	Cb_b_tab[cb] = (116130 * x + ONE_HALF) >> 16
+ *	             = 2*x + ((-14942 * x + 32768) >> 16)
+ *	green        = (-22554 * xb - 46802 * xr + ONE_HALF) >> 16
+ *	             = -xr + ((-22554 * xb + 18734 * xr + 32768) >> 16)
+ * where the right hand sides only need 16-bit multipliers, so each one is
+ * a single multiply-add of (x, 2) or (xb, xr) pairs into 32-bit lanes.
+ * Clamping Y + term to 0..255 stands in for range_limit[], and the result
+ * is identical to the table driven code for every input.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jsimd.h"
+
+#if defined(UPSAMPLE_MERGING_SUPPORTED) && defined(JSIMD_SUPPORTED)
+
+#ifdef JSIMD_ARCH_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+
+/* Where each 8-bit component lands in a pixel: (c >> loss) << pos */
+
+typedef struct {
+  int r_loss, r_pos;
+  int g_loss, g_pos;
+  int b_loss, b_pos;
+} hicolor_layout;
+
+static const hicolor_layout hicolor_layouts[] = {
+  { 0, 0,  0, 0,  0, 0 },		/* unused */
+  { 3, 11, 2, 5,  3, 0 },		/* JSIMD_RGB565 */
+  { 3, 10, 3, 5,  3, 0 },		/* JSIMD_RGB555 */
+  { 3, 0,  3, 5,  3, 10 }		/* JSIMD_BGR555 */
+};
+
+
+#ifdef JSIMD_ARCH_X86
+
+/* Multiplier pairs for _mm_madd_epi16(), low word first */
+#define PAIR_SSE2(lo, hi)  _mm_set1_epi32((int) (((unsigned int) (hi) << 16) | \
+					  ((unsigned int) (lo) & 0xFFFF)))
+#define PAIR_AVX2(lo, hi)  _mm256_set1_epi32((int) (((unsigned int) (hi) << 16) | \
+					  ((unsigned int) (lo) & 0xFFFF)))
+
+
+/*
+ * SSE2: 8 chroma samples, 16 pixels of each of the two rows per iteration.
+ */
+
+JSIMD_TARGET("sse2") LOCAL(__m128i)
+pack_sse2 (__m128i r, __m128i g, __m128i b, const hicolor_layout * layout)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i max = _mm_set1_epi16(MAXJSAMPLE);
+
+  /* Clamp to the sample range, just like range_limit[] */
+  r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+  g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+  b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+
+  r = _mm_sll_epi16(_mm_srl_epi16(r, _mm_cvtsi32_si128(layout->r_loss)),
+		    _mm_cvtsi32_si128(layout->r_pos));
+  g = _mm_sll_epi16(_mm_srl_epi16(g, _mm_cvtsi32_si128(layout->g_loss)),
+		    _mm_cvtsi32_si128(layout->g_pos));
+  b = _mm_sll_epi16(_mm_srl_epi16(b, _mm_cvtsi32_si128(layout->b_loss)),
+		    _mm_cvtsi32_si128(layout->b_pos));
+  return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+JSIMD_TARGET("sse2") LOCAL(void)
+store_sse2 (JSAMPROW outptr, __m128i pix0, __m128i pix1, boolean dbl,
+	    long dup)
+{
+  __m128i p0, p1, p2, p3;
+
+  if (dbl) {
+    p0 = _mm_unpacklo_epi16(pix0, pix0);
+    p1 = _mm_unpackhi_epi16(pix0, pix0);
+    p2 = _mm_unpacklo_epi16(pix1, pix1);
+    p3 = _mm_unpackhi_epi16(pix1, pix1);
+    _mm_storeu_si128((__m128i *) outptr, p0);
+    _mm_storeu_si128((__m128i *) (outptr + 16), p1);
+    _mm_storeu_si128((__m128i *) (outptr + 32), p2);
+    _mm_storeu_si128((__m128i *) (outptr + 48), p3);
+    if (dup) {
+      outptr += dup;
+      _mm_storeu_si128((__m128i *) outptr, p0);
+      _mm_storeu_si128((__m128i *) (outptr + 16), p1);
+      _mm_storeu_si128((__m128i *) (outptr + 32), p2);
+      _mm_storeu_si128((__m128i *) (outptr + 48), p3);
+    }
+  } else {
+    _mm_storeu_si128((__m128i *) outptr, pix0);
+    _mm_storeu_si128((__m128i *) (outptr + 16), pix1);
+  }
+}
+
+JSIMD_TARGET("sse2") LOCAL(JDIMENSION)
+h2v2_hicolor_sse2 (const hicolor_layout * layout, boolean dbl,
+		   JDIMENSION pairs, JSAMPROW inptr00, JSAMPROW inptr01,
+		   JSAMPROW inptr1, JSAMPROW inptr2,
+		   JSAMPROW outptr0, JSAMPROW outptr1, long dup0, long dup1)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i center = _mm_set1_epi16(CENTERJSAMPLE);
+  const __m128i two = _mm_set1_epi16(2);
+  const __m128i k_r = PAIR_SSE2(26345, 16384);
+  const __m128i k_b = PAIR_SSE2(-14942, 16384);
+  const __m128i k_g = PAIR_SSE2(-22554, 18734);
+  const __m128i half = _mm_set1_epi32(32768);
+  int bytes = dbl ? 4 : 2;
+  JDIMENSION col;
+  __m128i xb, xr, lo, hi, cred, cgreen, cblue;
+  __m128i cr0, cr1, cg0, cg1, cb0, cb1, y, y0, y1;
+
+  for (col = 0; col + 8 <= pairs; col += 8) {
+    /* Do the chroma part of the calculation for 8 pairs of columns */
+    xb = _mm_sub_epi16(_mm_unpacklo_epi8(
+		_mm_loadl_epi64((const __m128i *) (inptr1 + col)), zero), center);
+    xr = _mm_sub_epi16(_mm_unpacklo_epi8(
+		_mm_loadl_epi64((const __m128i *) (inptr2 + col)), zero), center);
+
+    lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(xr, two), k_r), 16);
+    hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(xr, two), k_r), 16);
+    cred = _mm_add_epi16(_mm_packs_epi32(lo, hi), xr);
+
+    lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(xb, two), k_b), 16);
+    hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(xb, two), k_b), 16);
+    cblue = _mm_add_epi16(_mm_packs_epi32(lo, hi), _mm_add_epi16(xb, xb));
+
+    lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(
+		_mm_unpacklo_epi16(xb, xr), k_g), half), 16);
+    hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(
+		_mm_unpackhi_epi16(xb, xr), k_g), half), 16);
+    cgreen = _mm_sub_epi16(_mm_packs_epi32(lo, hi), xr);
+
+    /* Each chroma term covers two adjacent columns */
+    cr0 = _mm_unpacklo_epi16(cred, cred);
+    cr1 = _mm_unpackhi_epi16(cred, cred);
+    cg0 = _mm_unpacklo_epi16(cgreen, cgreen);
+    cg1 = _mm_unpackhi_epi16(cgreen, cgreen);
+    cb0 = _mm_unpacklo_epi16(cblue, cblue);
+    cb1 = _mm_unpackhi_epi16(cblue, cblue);
+
+    /* Fetch 16 Y values from each row and emit 32 pixels */
+    y = _mm_loadu_si128((const __m128i *) (inptr00 + 2*col));
+    y0 = _mm_unpacklo_epi8(y, zero);
+    y1 = _mm_unpackhi_epi8(y, zero);
+    store_sse2(outptr0 + 2*col*bytes,
+	       pack_sse2(_mm_add_epi16(y0, cr0), _mm_add_epi16(y0, cg0),
+			 _mm_add_epi16(y0, cb0), layout),
+	       pack_sse2(_mm_add_epi16(y1, cr1), _mm_add_epi16(y1, cg1),
+			 _mm_add_epi16(y1, cb1), layout), dbl, dup0);
+    y = _mm_loadu_si128((const __m128i *) (inptr01 + 2*col));
+    y0 = _mm_unpacklo_epi8(y, zero);
+    y1 = _mm_unpackhi_epi8(y, zero);
+    store_sse2(outptr1 + 2*col*bytes,
+	       pack_sse2(_mm_add_epi16(y0, cr0), _mm_add_epi16(y0, cg0),
+			 _mm_add_epi16(y0, cb0), layout),
+	       pack_sse2(_mm_add_epi16(y1, cr1), _mm_add_epi16(y1, cg1),
+			 _mm_add_epi16(y1, cb1), layout), dbl, dup1);
+  }
+  return col;
+}
+
+
+/*
+ * AVX2: 16 chroma samples, 32 pixels of each of the two rows per iteration.
+ * Unpacking works within 128-bit lanes, so the duplicated chroma terms
+ * are put back in column order with a lane permute.
+ */
+
+JSIMD_TARGET("avx2") LOCAL(__m256i)
+pack_avx2 (__m256i r, __m256i g, __m256i b, const hicolor_layout * layout)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max = _mm256_set1_epi16(MAXJSAMPLE);
+
+  r = _mm256_min_epi16(_mm256_max_epi16(r, zero), max);
+  g = _mm256_min_epi16(_mm256_max_epi16(g, zero), max);
+  b = _mm256_min_epi16(_mm256_max_epi16(b, zero), max);
+
+  r = _mm256_sll_epi16(_mm256_srl_epi16(r, _mm_cvtsi32_si128(layout->r_loss)),
+		       _mm_cvtsi32_si128(layout->r_pos));
+  g = _mm256_sll_epi16(_mm256_srl_epi16(g, _mm_cvtsi32_si128(layout->g_loss)),
+		       _mm_cvtsi32_si128(layout->g_pos));
+  b = _mm256_sll_epi16(_mm256_srl_epi16(b, _mm_cvtsi32_si128(layout->b_loss)),
+		       _mm_cvtsi32_si128(layout->b_pos));
+  return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+JSIMD_TARGET("avx2") LOCAL(void)
+store_avx2 (JSAMPROW outptr, __m256i pix0, __m256i pix1, boolean dbl,
+	    long dup)
+{
+  __m256i lo, hi, p0, p1, p2, p3;
+
+  if (dbl) {
+    lo = _mm256_unpacklo_epi16(pix0, pix0);
+    hi = _mm256_unpackhi_epi16(pix0, pix0);
+    p0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    p1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+    lo = _mm256_unpacklo_epi16(pix1, pix1);
+    hi = _mm256_unpackhi_epi16(pix1, pix1);
+    p2 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    p3 = _mm256_permute2x128_si256(lo, hi, 0x31);
+    _mm256_storeu_si256((__m256i *) outptr, p0);
+    _mm256_storeu_si256((__m256i *) (outptr + 32), p1);
+    _mm256_storeu_si256((__m256i *) (outptr + 64), p2);
+    _mm256_storeu_si256((__m256i *) (outptr + 96), p3);
+    if (dup) {
+      outptr += dup;
+      _mm256_storeu_si256((__m256i *) outptr, p0);
+      _mm256_storeu_si256((__m256i *) (outptr + 32), p1);
+      _mm256_storeu_si256((__m256i *) (outptr + 64), p2);
+      _mm256_storeu_si256((__m256i *) (outptr + 96), p3);
+    }
+  } else {
+    _mm256_storeu_si256((__m256i *) outptr, pix0);
+    _mm256_storeu_si256((__m256i *) (outptr + 32), pix1);
+  }
+}
+
+JSIMD_TARGET("avx2") LOCAL(JDIMENSION)
+h2v2_hicolor_avx2 (const hicolor_layout * layout, boolean dbl,
+		   JDIMENSION pairs, JSAMPROW inptr00, JSAMPROW inptr01,
+		   JSAMPROW inptr1, JSAMPROW inptr2,
+		   JSAMPROW outptr0, JSAMPROW outptr1, long dup0, long dup1)
+{
+  const __m256i center = _mm256_set1_epi16(CENTERJSAMPLE);
+  const __m256i two = _mm256_set1_epi16(2);
+  const __m256i k_r = PAIR_AVX2(26345, 16384);
+  const __m256i k_b = PAIR_AVX2(-14942, 16384);
+  const __m256i k_g = PAIR_AVX2(-22554, 18734);
+  const __m256i half = _mm256_set1_epi32(32768);
+  int bytes = dbl ? 4 : 2;
+  JDIMENSION col;
+  __m256i xb, xr, lo, hi, cred, cgreen, cblue;
+  __m256i cr0, cr1, cg0, cg1, cb0, cb1, y, y0, y1;
+
+  for (col = 0; col + 16 <= pairs; col += 16) {
+    /* Do the chroma part of the calculation for 16 pairs of columns */
+    xb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+		_mm_loadu_si128((const __m128i *) (inptr1 + col))), center);
+    xr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+		_mm_loadu_si128((const __m128i *) (inptr2 + col))), center);
+
+    lo = _mm256_srai_epi32(_mm256_madd_epi16(
+		_mm256_unpacklo_epi16(xr, two), k_r), 16);
+    hi = _mm256_srai_epi32(_mm256_madd_epi16(
+		_mm256_unpackhi_epi16(xr, two), k_r), 16);
+    cred = _mm256_add_epi16(_mm256_packs_epi32(lo, hi), xr);
+
+    lo = _mm256_srai_epi32(_mm256_madd_epi16(
+		_mm256_unpacklo_epi16(xb, two), k_b), 16);
+    hi = _mm256_srai_epi32(_mm256_madd_epi16(
+		_mm256_unpackhi_epi16(xb, two), k_b), 16);
+    cblue = _mm256_add_epi16(_mm256_packs_epi32(lo, hi),
+			     _mm256_add_epi16(xb, xb));
+
+    lo = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(
+		_mm256_unpacklo_epi16(xb, xr), k_g), half), 16);
+    hi = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(
+		_mm256_unpackhi_epi16(xb, xr), k_g), half), 16);
+    cgreen = _mm256_sub_epi16(_mm256_packs_epi32(lo, hi), xr);
+
+    /* Each chroma term covers two adjacent columns */
+    lo = _mm256_unpacklo_epi16(cred, cred);
+    hi = _mm256_unpackhi_epi16(cred, cred);
+    cr0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    cr1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+    lo = _mm256_unpacklo_epi16(cgreen, cgreen);
+    hi = _mm256_unpackhi_epi16(cgreen, cgreen);
+    cg0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    cg1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+    lo = _mm256_unpacklo_epi16(cblue, cblue);
+    hi = _mm256_unpackhi_epi16(cblue, cblue);
+    cb0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    cb1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+    /* Fetch 32 Y values from each row and emit 64 pixels */
+    y = _mm256_loadu_si256((const __m256i *) (inptr00 + 2*col));
+    y0 = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(y));
+    y1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(y, 1));
+    store_avx2(outptr0 + 2*col*bytes,
+	       pack_avx2(_mm256_add_epi16(y0, cr0), _mm256_add_epi16(y0, cg0),
+			 _mm256_add_epi16(y0, cb0), layout),
+	       pack_avx2(_mm256_add_epi16(y1, cr1), _mm256_add_epi16(y1, cg1),
+			 _mm256_add_epi16(y1, cb1), layout), dbl, dup0);
+    y = _mm256_loadu_si256((const __m256i *) (inptr01 + 2*col));
+    y0 = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(y));
+    y1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(y, 1));
+    store_avx2(outptr1 + 2*col*bytes,
+	       pack_avx2(_mm256_add_epi16(y0, cr0), _mm256_add_epi16(y0, cg0),
+			 _mm256_add_epi16(y0, cb0), layout),
+	       pack_avx2(_mm256_add_epi16(y1, cr1), _mm256_add_epi16(y1, cg1),
+			 _mm256_add_epi16(y1, cb1), layout), dbl, dup1);
+  }
+
+  /* Let SSE2 pick up a remaining group of 8 */
+  return col + h2v2_hicolor_sse2(layout, dbl, pairs - col,
+				 inptr00 + 2*col, inptr01 + 2*col,
+				 inptr1 + col, inptr2 + col,
+				 outptr0 + 2*col*bytes, outptr1 + 2*col*bytes,
+				 dup0, dup1);
+}
+
+#endif /* JSIMD_ARCH_X86 */
+
+
+/*
+ * Pick the widest routine this CPU can run.
+ */
+
+GLOBAL(JDIMENSION)
+jsimd_h2v2_merged_hicolor (int format, boolean dbl, JDIMENSION pairs,
+			   JSAMPROW inptr00, JSAMPROW inptr01,
+			   JSAMPROW inptr1, JSAMPROW inptr2,
+			   JSAMPROW outptr0, JSAMPROW outptr1,
+			   long dup0, long dup1)
+{
+  const hicolor_layout * layout = &hicolor_layouts[format];
+  unsigned int simd = jsimd_cpu_support();
+
+#ifdef JSIMD_ARCH_X86
+  if (simd & JSIMD_AVX2)
+    return h2v2_hicolor_avx2(layout, dbl, pairs, inptr00, inptr01,
+			     inptr1, inptr2, outptr0, outptr1, dup0, dup1);
+  if (simd & JSIMD_SSE2)
+    return h2v2_hicolor_sse2(layout, dbl, pairs, inptr00, inptr01,
+			     inptr1, inptr2, outptr0, outptr1, dup0, dup1);
+#endif
+  return 0;
+}
+
+#endif /* UPSAMPLE_MERGING_SUPPORTED && JSIMD_SUPPORTED */
@@ -0,0 +1,358 @@
+/*
+ * jidctvec.c
+ *
+ * This file is part of the SMJPEG modifications to the Independent JPEG
+ * Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains vectorized versions of the fast, not so accurate
+ * integer IDCT in jidctfst.c.  Read that file first.
+ *
+ * The arithmetic is exactly that of jpeg_idct_ifast, done on 32-bit lanes
+ * so that products and sums wrap just like the int DCTELEMs there.  Each
+ * 1-D pass works on whole columns (first pass) or rows (second pass) at
+ * once, with a transpose in between and another one at the end.  There
+ * is no need for the zero-AC shortcuts: they give the same answer as the
+ * full calculation.
+ *
+ * The output stage replaces the range_limit[] lookup: with v = x >> 5
+ * taken modulo 1024 as a signed 10-bit value, the post-IDCT table holds
+ * v + CENTERJSAMPLE clamped to 0..MAXJSAMPLE, which the saturating packs
+ * provide.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jdct.h"		/* Private declarations for DCT subsystem */
+#include "jsimd.h"
+
+#if defined(JSIMD_SUPPORTED) && defined(DCT_IFAST_SUPPORTED) && \
+    BITS_IN_JSAMPLE == 8 && DCTSIZE == 8 && \
+    !defined(USE_ACCURATE_ROUNDING) && !defined(RIGHT_SHIFT_IS_UNSIGNED)
+#define IDCT_VECTORS_OK
+#endif
+
+#ifdef IDCT_VECTORS_OK
+
+#ifdef JSIMD_ARCH_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+/* The constants of jidctfst.c (CONST_BITS = 8) */
+#define FIX_1_082392200  277
+#define FIX_1_414213562  362
+#define FIX_1_847759065  473
+#define FIX_2_613125930  669
+
+#define CONST_BITS  8
+
+
+#ifdef JSIMD_ARCH_X86
+
+/*
+ * SSE2: the block is handled as two halves of four columns, four 32-bit
+ * lanes per register.  SSE2 has no 32-bit multiply, so build one.
+ */
+
+JSIMD_TARGET("sse2") LOCAL(__m128i)
+mullo_sse2 (__m128i a, __m128i b)
+{
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+			    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+#define MULTIPLY_SSE2(var,const) \
+	_mm_srai_epi32(mullo_sse2(var, _mm_set1_epi32(const)), CONST_BITS)
+
+JSIMD_TARGET("sse2") LOCAL(void)
+idct_1d_sse2 (__m128i * v)
+{
+  __m128i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+  __m128i tmp10, tmp11, tmp12, tmp13;
+  __m128i z5, z10, z11, z12, z13;
+
+  /* Even part */
+
+  tmp10 = _mm_add_epi32(v[0], v[4]);
+  tmp11 = _mm_sub_epi32(v[0], v[4]);
+
+  tmp13 = _mm_add_epi32(v[2], v[6]);
+  tmp12 = _mm_sub_epi32(MULTIPLY_SSE2(_mm_sub_epi32(v[2], v[6]),
+				      FIX_1_414213562), tmp13);
+
+  tmp0 = _mm_add_epi32(tmp10, tmp13);
+  tmp3 = _mm_sub_epi32(tmp10, tmp13);
+  tmp1 = _mm_add_epi32(tmp11, tmp12);
+  tmp2 = _mm_sub_epi32(tmp11, tmp12);
+
+  /* Odd part */
+
+  z13 = _mm_add_epi32(v[5], v[3]);
+  z10 = _mm_sub_epi32(v[5], v[3]);
+  z11 = _mm_add_epi32(v[1], v[7]);
+  z12 = _mm_sub_epi32(v[1], v[7]);
+
+  tmp7 = _mm_add_epi32(z11, z13);
+  tmp11 = MULTIPLY_SSE2(_mm_sub_epi32(z11, z13), FIX_1_414213562);
+
+  z5 = MULTIPLY_SSE2(_mm_add_epi32(z10, z12), FIX_1_847759065);
+  tmp10 = _mm_sub_epi32(MULTIPLY_SSE2(z12, FIX_1_082392200), z5);
+  tmp12 = _mm_add_epi32(MULTIPLY_SSE2(z10, - FIX_2_613125930), z5);
+
+  tmp6 = _mm_sub_epi32(tmp12, tmp7);
+  tmp5 = _mm_sub_epi32(tmp11, tmp6);
+  tmp4 = _mm_add_epi32(tmp10, tmp5);
+
+  v[0] = _mm_add_epi32(tmp0, tmp7);
+  v[7] = _mm_sub_epi32(tmp0, tmp7);
+  v[1] = _mm_add_epi32(tmp1, tmp6);
+  v[6] = _mm_sub_epi32(tmp1, tmp6);
+  v[2] = _mm_add_epi32(tmp2, tmp5);
+  v[5] = _mm_sub_epi32(tmp2, tmp5);
+  v[4] = _mm_add_epi32(tmp3, tmp4);
+  v[3] = _mm_sub_epi32(tmp3, tmp4);
+}
+
+/* Transpose the 4x4 block in in[0..3] into out[0..3] */
+JSIMD_TARGET("sse2") LOCAL(void)
+transpose_sse2 (const __m128i * in, __m128i * out)
+{
+  __m128i t0 = _mm_unpacklo_epi32(in[0], in[1]);
+  __m128i t1 = _mm_unpacklo_epi32(in[2], in[3]);
+  __m128i t2 = _mm_unpackhi_epi32(in[0], in[1]);
+  __m128i t3 = _mm_unpackhi_epi32(in[2], in[3]);
+
+  out[0] = _mm_unpacklo_epi64(t0, t1);
+  out[1] = _mm_unpackhi_epi64(t0, t1);
+  out[2] = _mm_unpacklo_epi64(t2, t3);
+  out[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+/* Scale down by a factor of 8 and undo PASS1_BITS, as signed 10 bits */
+#define DESCALE_SSE2(x) \
+	_mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(x, 17), 22), \
+		      _mm_set1_epi32(CENTERJSAMPLE))
+
+JSIMD_TARGET("sse2") LOCAL(void)
+jsimd_idct_ifast_sse2 (j_decompress_ptr cinfo, jpeg_component_info * compptr,
+		       JCOEFPTR coef_block,
+		       JSAMPARRAY output_buf, JDIMENSION output_col)
+{
+  const int * quantptr = (const int *) compptr->dct_table;
+  __m128i left[8], right[8], top[8], bottom[8], out[8];
+  __m128i coef, row0, row1;
+  int i;
+
+  /* Dequantize, one row of both halves at a time */
+  for (i = 0; i < DCTSIZE; i++) {
+    coef = _mm_loadu_si128((const __m128i *) (coef_block + i*DCTSIZE));
+    left[i] = mullo_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(coef, coef), 16),
+		_mm_loadu_si128((const __m128i *) (quantptr + i*DCTSIZE)));
+    right[i] = mullo_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(coef, coef), 16),
+		_mm_loadu_si128((const __m128i *) (quantptr + i*DCTSIZE + 4)));
+  }
+
+  /* Pass 1: process columns */
+  idct_1d_sse2(left);
+  idct_1d_sse2(right);
+
+  /* Pass 2: process rows, top four and bottom four */
+  transpose_sse2(left, top);
+  transpose_sse2(right, top + 4);
+  transpose_sse2(left + 4, bottom);
+  transpose_sse2(right + 4, bottom + 4);
+  idct_1d_sse2(top);
+  idct_1d_sse2(bottom);
+
+  /* Final output stage: descale, range-limit and store rows */
+  for (i = 0; i < DCTSIZE; i++) {
+    top[i] = DESCALE_SSE2(top[i]);
+    bottom[i] = DESCALE_SSE2(bottom[i]);
+  }
+  transpose_sse2(top, out);
+  transpose_sse2(top + 4, out + 4);
+  for (i = 0; i < 4; i += 2) {
+    row0 = _mm_packs_epi32(out[i], out[i+4]);
+    row1 = _mm_packs_epi32(out[i+1], out[i+5]);
+    row0 = _mm_packus_epi16(row0, row1);
+    _mm_storel_epi64((__m128i *) (output_buf[i] + output_col), row0);
+    _mm_storel_epi64((__m128i *) (output_buf[i+1] + output_col),
+		     _mm_srli_si128(row0, 8));
+  }
+  transpose_sse2(bottom, out);
+  transpose_sse2(bottom + 4, out + 4);
+  for (i = 0; i < 4; i += 2) {
+    row0 = _mm_packs_epi32(out[i], out[i+4]);
+    row1 = _mm_packs_epi32(out[i+1], out[i+5]);
+    row0 = _mm_packus_epi16(row0, row1);
+    _mm_storel_epi64((__m128i *) (output_buf[i+4] + output_col), row0);
+    _mm_storel_epi64((__m128i *) (output_buf[i+5] + output_col),
+		     _mm_srli_si128(row0, 8));
+  }
+}
+
+
+/*
+ * AVX2: one row of eight 32-bit lanes per register.
+ */
+
+#define MULTIPLY_AVX2(var,const) \
+	_mm256_srai_epi32(_mm256_mullo_epi32(var, _mm256_set1_epi32(const)), \
+			  CONST_BITS)
+
+JSIMD_TARGET("avx2") LOCAL(void)
+idct_1d_avx2 (__m256i * v)
+{
+  __m256i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+  __m256i tmp10, tmp11, tmp12, tmp13;
+  __m256i z5, z10, z11, z12, z13;
+
+  /* Even part */
+
+  tmp10 = _mm256_add_epi32(v[0], v[4]);
+  tmp11 = _mm256_sub_epi32(v[0], v[4]);
+
+  tmp13 = _mm256_add_epi32(v[2], v[6]);
+  tmp12 = _mm256_sub_epi32(MULTIPLY_AVX2(_mm256_sub_epi32(v[2], v[6]),
+					 FIX_1_414213562), tmp13);
+
+  tmp0 = _mm256_add_epi32(tmp10, tmp13);
+  tmp3 = _mm256_sub_epi32(tmp10, tmp13);
+  tmp1 = _mm256_add_epi32(tmp11, tmp12);
+  tmp2 = _mm256_sub_epi32(tmp11, tmp12);
+
+  /* Odd part */
+
+  z13 = _mm256_add_epi32(v[5], v[3]);
+  z10 = _mm256_sub_epi32(v[5], v[3]);
+  z11 = _mm256_add_epi32(v[1], v[7]);
+  z12 = _mm256_sub_epi32(v[1], v[7]);
+
+  tmp7 = _mm256_add_epi32(z11, z13);
+  tmp11 = MULTIPLY_AVX2(_mm256_sub_epi32(z11, z13), FIX_1_414213562);
+
+  z5 = MULTIPLY_AVX2(_mm256_add_epi32(z10, z12), FIX_1_847759065);
+  tmp10 = _mm256_sub_epi32(MULTIPLY_AVX2(z12, FIX_1_082392200), z5);
+  tmp12 = _mm256_add_epi32(MULTIPLY_AVX2(z10, - FIX_2_613125930), z5);
+
+  tmp6 = _mm256_sub_epi32(tmp12, tmp7);
+  tmp5 = _mm256_sub_epi32(tmp11, tmp6);
+  tmp4 = _mm256_add_epi32(tmp10, tmp5);
+
+  v[0] = _mm256_add_epi32(tmp0, tmp7);
+  v[7] = _mm256_sub_epi32(tmp0, tmp7);
+  v[1] = _mm256_add_epi32(tmp1, tmp6);
+  v[6] = _mm256_sub_epi32(tmp1, tmp6);
+  v[2] = _mm256_add_epi32(tmp2, tmp5);
+  v[5] = _mm256_sub_epi32(tmp2, tmp5);
+  v[4] = _mm256_add_epi32(tmp3, tmp4);
+  v[3] = _mm256_sub_epi32(tmp3, tmp4);
+}
+
+/* Transpose the 8x8 block in v[0..7] in place */
+JSIMD_TARGET("avx2") LOCAL(void)
+transpose_avx2 (__m256i * v)
+{
+  __m256i t[8], u[8];
+  int i;
+
+  for (i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_epi32(v[i], v[i+1]);
+    t[i+1] = _mm256_unpackhi_epi32(v[i], v[i+1]);
+  }
+  for (i = 0; i < 8; i += 4) {
+    u[i] = _mm256_unpacklo_epi64(t[i], t[i+2]);
+    u[i+1] = _mm256_unpackhi_epi64(t[i], t[i+2]);
+    u[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+    u[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+  }
+  for (i = 0; i < 4; i++) {
+    v[i] = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+    v[i+4] = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+  }
+}
+
+#define DESCALE_AVX2(x) \
+	_mm256_add_epi32(_mm256_srai_epi32(_mm256_slli_epi32(x, 17), 22), \
+			 _mm256_set1_epi32(CENTERJSAMPLE))
+
+JSIMD_TARGET("avx2") LOCAL(void)
+jsimd_idct_ifast_avx2 (j_decompress_ptr cinfo, jpeg_component_info * compptr,
+		       JCOEFPTR coef_block,
+		       JSAMPARRAY output_buf, JDIMENSION output_col)
+{
+  const int * quantptr = (const int *) compptr->dct_table;
+  __m256i v[8], rows01, rows23;
+  __m128i lo, hi;
+  int i;
+
+  /* Dequantize */
+  for (i = 0; i < DCTSIZE; i++) {
+    v[i] = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(
+		_mm_loadu_si128((const __m128i *) (coef_block + i*DCTSIZE))),
+		_mm256_loadu_si256((const __m256i *) (quantptr + i*DCTSIZE)));
+  }
+
+  /* Pass 1: process columns */
+  idct_1d_avx2(v);
+
+  /* Pass 2: process rows */
+  transpose_avx2(v);
+  idct_1d_avx2(v);
+
+  /* Final output stage: descale, range-limit and store rows */
+  for (i = 0; i < DCTSIZE; i++)
+    v[i] = DESCALE_AVX2(v[i]);
+  transpose_avx2(v);
+  for (i = 0; i < DCTSIZE; i += 4) {
+    rows01 = _mm256_permute4x64_epi64(_mm256_packs_epi32(v[i], v[i+1]), 0xD8);
+    rows23 = _mm256_permute4x64_epi64(_mm256_packs_epi32(v[i+2], v[i+3]),
+				      0xD8);
+    rows01 = _mm256_packus_epi16(rows01, rows23);
+    lo = _mm256_castsi256_si128(rows01);	/* rows i and i+2 */
+    hi = _mm256_extracti128_si256(rows01, 1);	/* rows i+1 and i+3 */
+    _mm_storel_epi64((__m128i *) (output_buf[i] + output_col), lo);
+    _mm_storel_epi64((__m128i *) (output_buf[i+1] + output_col), hi);
+    _mm_storel_epi64((__m128i *) (output_buf[i+2] + output_col),
+		     _mm_srli_si128(lo, 8));
+    _mm_storel_epi64((__m128i *) (output_buf[i+3] + output_col),
+		     _mm_srli_si128(hi, 8));
+  }
+}
+
+#endif /* JSIMD_ARCH_X86 */
+
+#endif /* IDCT_VECTORS_OK */
+
+
+#ifdef JSIMD_SUPPORTED
+
+/*
+ * Pick the widest IDCT this CPU can run, or NULL to use jpeg_idct_ifast.
+ */
+
+GLOBAL(inverse_DCT_method_ptr)
+jsimd_idct_ifast_method (void)
+{
+#ifdef IDCT_VECTORS_OK
+  unsigned int simd = jsimd_cpu_support();
+
+  /* The vector code loads the multiplier table as ints */
+  if (SIZEOF(IFAST_MULT_TYPE) != SIZEOF(int) || SIZEOF(int) != 4)
+    return NULL;
+#ifdef JSIMD_ARCH_X86
+  if (simd & JSIMD_AVX2)
+    return jsimd_idct_ifast_avx2;
+  if (simd & JSIMD_SSE2)
+    return jsimd_idct_ifast_sse2;
+#endif
+#endif /* IDCT_VECTORS_OK */
+  return NULL;
+}
+
+#endif /* JSIMD_SUPPORTED */
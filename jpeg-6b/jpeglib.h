@@ -219,7 +219,11 @@ typedef enum {
 	JCS_RGB16_565_DBL,      /* hicolor with 2x1 pixels */
 	JCS_BGR,                /* blue/green/red 24 bit */
 	JCS_RGB_DBL,
-	JCS_BGR_DBL
+	JCS_BGR_DBL,
+	JCS_XRGB32,		/* 32-bit words 0xFFRRGGBB in native order */
+	JCS_XBGR32,		/* 32-bit words 0xFFBBGGRR in native order */
+	JCS_XRGB32_DBL,
+	JCS_XBGR32_DBL		/* 32-bit with 2x1 pixels */
 } J_COLOR_SPACE;
 
 #define JCS_RGB24 JCS_RGB
@@ -461,6 +465,10 @@ struct jpeg_decompress_struct {
   boolean enable_1pass_quant;	/* enable future use of 1-pass quantizer */
   boolean enable_external_quant;/* enable future use of external colormap */
   boolean enable_2pass_quant;	/* enable future use of 2-pass quantizer */
+  /* Zebaoth-specific extension: the _DBL output spaces also store every
+   * output row this many bytes further on, to double it vertically.
+   */
+  long dbl_row_offset;		/* 0 = don't */
 
   /* Description of actual output image that will be returned to application.
    * These fields are computed by jpeg_start_decompress().
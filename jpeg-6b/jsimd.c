@@ -0,0 +1,113 @@
+/*
+ * jsimd.c
+ *
+ * This file is part of the SMJPEG modifications to the Independent JPEG
+ * Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains the runtime CPU detection for the vectorized
+ * decompression routines.  See jsimd.h for the controls.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jsimd.h"
+
+#ifdef JSIMD_SUPPORTED
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+
+/*
+ * Ask the processor (and for AVX2, the OS) what it supports.
+ */
+
+LOCAL(unsigned int)
+detect_x86 (void)
+{
+  unsigned int regs[4];
+  unsigned int flags = 0;
+  unsigned int xcr0 = 0;
+
+#ifdef _MSC_VER
+  __cpuid((int *) regs, 0);
+  if (regs[0] < 1)
+    return 0;
+  __cpuid((int *) regs, 1);
+#else
+  if (! __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]))
+    return 0;
+#endif
+  if (regs[3] & (1 << 26))
+    flags |= JSIMD_SSE2;
+
+  /* AVX2 needs the OS to save the YMM registers (OSXSAVE and XCR0) */
+  if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28))) {
+#ifdef _MSC_VER
+    xcr0 = (unsigned int) _xgetbv(0);
+    __cpuidex((int *) regs, 7, 0);
+#else
+    __asm__ ("xgetbv" : "=a" (xcr0) : "c" (0) : "%edx");
+    if (__get_cpuid_max(0, NULL) >= 7)
+      __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+    else
+      regs[1] = 0;
+#endif
+    if (((xcr0 & 6) == 6) && (regs[1] & (1 << 5)))
+      flags |= JSIMD_AVX2;
+  }
+  return flags;
+}
+
+
+/*
+ * The answer is kept in one word, with JSIMD_CHECKED set once it is known.
+ * Decompressors on several threads may ask at the same time, so the word is
+ * only read and written atomically; threads that race to fill it in all
+ * store the same value.
+ */
+
+#define JSIMD_CHECKED	0x80000000U
+
+#ifdef _MSC_VER
+/* Volatile accesses to an aligned word are atomic on x86 with MSVC */
+#define LOAD_SUPPORT()		(*(volatile unsigned int *) &simd_support)
+#define STORE_SUPPORT(v)	(*(volatile unsigned int *) &simd_support = (v))
+#else
+#define LOAD_SUPPORT()		__atomic_load_n(&simd_support, __ATOMIC_ACQUIRE)
+#define STORE_SUPPORT(v)	__atomic_store_n(&simd_support, (v), __ATOMIC_RELEASE)
+#endif
+
+static unsigned int simd_support = 0;
+
+
+/*
+ * Return the vector instruction sets we may use, checked only once.
+ */
+
+GLOBAL(unsigned int)
+jsimd_cpu_support (void)
+{
+  const char * env;
+  unsigned int flags = LOAD_SUPPORT();
+
+  if (flags & JSIMD_CHECKED)
+    return flags & ~JSIMD_CHECKED;
+
+  flags = detect_x86();
+
+  if ((env = getenv("JSIMD_FORCESSE2")) != NULL && strcmp(env, "1") == 0)
+    flags &= JSIMD_SSE2;
+  if ((env = getenv("JSIMD_FORCENONE")) != NULL && strcmp(env, "1") == 0)
+    flags = 0;
+
+  STORE_SUPPORT(flags | JSIMD_CHECKED);
+  return flags;
+}
+
+#endif /* JSIMD_SUPPORTED */
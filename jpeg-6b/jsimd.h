@@ -0,0 +1,74 @@
+/*
+ * jsimd.h
+ *
+ * This file is part of the SMJPEG modifications to the Independent JPEG
+ * Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This include file declares the vectorized (SSE2 or AVX2) versions
+ * of some of the decompression inner loops, and the runtime CPU detection
+ * used to pick them.  It is private to the JPEG library (JPEG_INTERNALS).
+ * The portable C code remains the reference: every vector routine must
+ * produce exactly the same output as the code it replaces, and leaves any
+ * part of a row it can't handle to that code.
+ *
+ * Define NO_SIMD to build without any of this.  At runtime, setting the
+ * environment variable JSIMD_FORCENONE=1 disables the vector routines and
+ * JSIMD_FORCESSE2=1 limits x86 machines to the SSE2 versions.
+ */
+
+#ifndef NO_SIMD
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)) || \
+     defined(__clang__))
+#define JSIMD_ARCH_X86
+#define JSIMD_TARGET(isa)	__attribute__((target(isa)))
+#endif
+#if defined(_MSC_VER) && (_MSC_VER >= 1900) && \
+    (defined(_M_IX86) || defined(_M_X64))
+#define JSIMD_ARCH_X86
+#define JSIMD_TARGET(isa)
+#endif
+#endif /* NO_SIMD */
+
+#ifdef JSIMD_ARCH_X86
+#define JSIMD_SUPPORTED
+#endif
+
+#ifdef JSIMD_SUPPORTED
+
+/* Instruction sets reported by jsimd_cpu_support() */
+#define JSIMD_SSE2	0x01
+#define JSIMD_AVX2	0x02
+
+/* Pixel formats for the merged hicolor upsampler */
+#define JSIMD_RGB565	1
+#define JSIMD_RGB555	2
+#define JSIMD_BGR555	3
+
+/* Short forms of external names for systems with brain-damaged linkers. */
+
+#ifdef NEED_SHORT_EXTERNAL_NAMES
+#define jsimd_cpu_support	jSCpuSupport
+#define jsimd_h2v2_merged_hicolor	jSH2V2Hicolor
+#define jsimd_idct_ifast_method	jSIdctIfast
+#endif /* NEED_SHORT_EXTERNAL_NAMES */
+
+EXTERN(unsigned int) jsimd_cpu_support JPP((void));
+
+/* Converts as many pairs of output columns of an h2v2 row group as it can
+ * to hicolor pixels (each doubled horizontally if dbl is set), and returns
+ * the number of pairs done.  When dbl is set, each output row is also
+ * stored dup0 or dup1 bytes further on, unless that is 0.
+ */
+EXTERN(JDIMENSION) jsimd_h2v2_merged_hicolor
+	JPP((int format, boolean dbl, JDIMENSION pairs,
+	     JSAMPROW inptr00, JSAMPROW inptr01,
+	     JSAMPROW inptr1, JSAMPROW inptr2,
+	     JSAMPROW outptr0, JSAMPROW outptr1,
+	     long dup0, long dup1));
+
+/* Returns a vector equivalent of jpeg_idct_ifast, or NULL if there is none */
+EXTERN(inverse_DCT_method_ptr) jsimd_idct_ifast_method JPP((void));
+
+#endif /* JSIMD_SUPPORTED */
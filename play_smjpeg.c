@@ -16,10 +16,12 @@
 void Usage(const char *argv0)
 {
     printf("SMJPEG " VERSION " decoder, Loki Entertainment Software and Fat N Soft\n");
-    printf("Usage: %s [-2] [-l] [-f] [-v] file.mjpg [file.mjpg ...]\n", argv0);
+    printf("Usage: %s [-2] [-l] [-f] [-q frames] [-t threads] [-v] file.mjpg [file.mjpg ...]\n", argv0);
     printf("-2 is double size video.\n");
     printf("-l is loop video playback.\n");
     printf("-f is fullscreen playback.\n");
+    printf("-q decodes up to the given number of frames ahead in a thread.\n");
+    printf("-t decodes frames on the given number of threads.\n");
     printf("-v displays version.\n");
 }
 
@@ -31,6 +33,8 @@ int main(int argc, char *argv[])
     int loopflag;
     int fullflag;
     int bpp;
+    int queue;
+    int threads;
 
     if ( SDL_Init(SDL_INIT_AUDIO|SDL_INIT_VIDEO) < 0 ) {
         fprintf(stderr, "Couldn't init SDL: %s\n", SDL_GetError());
@@ -42,6 +46,8 @@ int main(int argc, char *argv[])
     loopflag = 0;
     fullflag = 0;
     bpp = 16;
+    queue = 0;
+    threads = 1;
     for ( i=1; argv[i]; ++i ) {
         if ( (strcmp(argv[i], "-h") == 0) ||
              (strcmp(argv[i], "--help") == 0) ) {
@@ -60,6 +66,16 @@ int main(int argc, char *argv[])
             fullflag = SDL_FULLSCREEN;
             continue;
         }
+        if ( (strcmp(argv[i], "-q") == 0) && argv[i+1] ) {
+            i ++;
+            queue = atoi(argv[i]);
+            continue;
+        }
+        if ( (strcmp(argv[i], "-t") == 0) && argv[i+1] ) {
+            i ++;
+            threads = atoi(argv[i]);
+            continue;
+        }
         if ( strcmp(argv[i], "-bpp") == 0 ) {
             i ++;
             bpp = atoi(argv[i]);
@@ -111,6 +127,8 @@ int main(int argc, char *argv[])
             }
             SMJPEG_double(&movie, doubleflag);
             SMJPEG_target(&movie, NULL, 0, 0, screen, SDL_UpdateRect);
+            SMJPEG_queue(&movie, queue);
+            SMJPEG_threads(&movie, threads);
         }
         if ( movie.audio.enabled ) {
             SDL_AudioSpec spec;
@@ -4,6 +4,13 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <string.h>
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "adpcm.h"
 #include "smjpeg_file.h"
@@ -19,7 +26,40 @@
 
 /* Macro for detecting the end of the SMJPEG stream */
 #define END_OF_STREAM(movie, magic) \
-    (movie->at_end || feof(movie->src) || MAGIC_EQUALS(magic, DATA_END_MAGIC))
+    (movie->at_end || src_eof(movie) || MAGIC_EQUALS(magic, DATA_END_MAGIC))
+
+/* Non-zero if a size doesn't fit the 32-bit offsets of a memory source
+   (shifted in two steps so it also works for 32-bit types)
+ */
+#define SIZE_OVER_32BITS(size) \
+    ((((size) >> 31) >> 1) != 0)
+
+/* Ordered access to the audio ring counters, see struct dataring */
+#if defined(__clang__) || (defined(__GNUC__) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 7))))
+#define RING_LOAD(x)        __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define RING_STORE(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define RING_FENCE()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+/* Volatile accesses are acquire/release on x86 and with MSVC */
+#define RING_LOAD(x)        (*(volatile Uint32 *)&(x))
+#define RING_STORE(x, v)    (*(volatile Uint32 *)&(x) = (v))
+#if defined(__GNUC__)
+#define RING_FENCE()        __sync_synchronize()
+#elif defined(_WIN32)
+#include <windows.h>
+#define RING_FENCE()        MemoryBarrier()
+#else
+#define RING_FENCE()
+#endif
+#endif
+
+/* The number of bytes the producer may add to the audio ring */
+#define RING_SPACE(ring) \
+    ((ring)->size - ((ring)->write - RING_LOAD((ring)->read)))
+
+/* Encoded audio is read and decoded this many bytes at a time */
+#define ADPCM_PIECE 1024
 
 /* Return values for block parsing functions */
 enum {
@@ -48,6 +88,175 @@ static void SMJPEG_status(SMJPEG *movie, int code, char *fmt, ...)
     }
 }
 
+/* Functions for reading from the data source: stdio, memory or RWops */
+static int src_read(SMJPEG *movie, void *buf, Uint32 len)
+{
+    if ( movie->mem.base ) {
+        if ( len > (movie->mem.size - movie->mem.pos) ) {
+            movie->mem.pos = movie->mem.size;
+            movie->mem.eof = 1;
+            return(0);
+        }
+        memcpy(buf, movie->mem.base + movie->mem.pos, len);
+        movie->mem.pos += len;
+        return(1);
+    }
+    if ( movie->rw.ops ) {
+        if ( SDL_RWread(movie->rw.ops, buf, len, 1) != 1 ) {
+            movie->rw.eof = 1;
+            return(0);
+        }
+        return(1);
+    }
+    return(fread(buf, len, 1, movie->src));
+}
+
+static Uint32 src_read32(SMJPEG *movie)
+{
+    Uint32 val;
+
+    if ( movie->mem.base ) {
+        if ( (movie->mem.size - movie->mem.pos) < 4 ) {
+            movie->mem.pos = movie->mem.size;
+            movie->mem.eof = 1;
+            return(0);
+        }
+        val = GET32(movie->mem.base + movie->mem.pos);
+        movie->mem.pos += 4;
+    } else if ( movie->rw.ops ) {
+        Uint8 data[4];
+
+        if ( ! src_read(movie, data, 4) ) {
+            return(0);
+        }
+        val = GET32(data);
+    } else {
+        READ32(val, movie->src);
+    }
+    return(val);
+}
+
+static Uint16 src_read16(SMJPEG *movie)
+{
+    Uint16 val;
+
+    if ( movie->mem.base ) {
+        if ( (movie->mem.size - movie->mem.pos) < 2 ) {
+            movie->mem.pos = movie->mem.size;
+            movie->mem.eof = 1;
+            return(0);
+        }
+        val = GET16(movie->mem.base + movie->mem.pos);
+        movie->mem.pos += 2;
+    } else if ( movie->rw.ops ) {
+        Uint8 data[2];
+
+        if ( ! src_read(movie, data, 2) ) {
+            return(0);
+        }
+        val = GET16(data);
+    } else {
+        READ16(val, movie->src);
+    }
+    return(val);
+}
+
+static Uint8 src_read8(SMJPEG *movie)
+{
+    Uint8 val;
+
+    if ( movie->mem.base ) {
+        if ( movie->mem.pos == movie->mem.size ) {
+            movie->mem.eof = 1;
+            return(0);
+        }
+        val = movie->mem.base[movie->mem.pos++];
+    } else if ( movie->rw.ops ) {
+        if ( ! src_read(movie, &val, 1) ) {
+            return(0);
+        }
+    } else {
+        READ8(val, movie->src);
+    }
+    return(val);
+}
+
+static int src_seek(SMJPEG *movie, long offset, int whence)
+{
+    if ( movie->mem.base ) {
+        if ( whence == SEEK_CUR ) {
+            offset += movie->mem.pos;
+        } else if ( whence == SEEK_END ) {
+            offset += movie->mem.size;
+        }
+        if ( offset < 0 ) {
+            return(-1);
+        }
+        /* Like fseek(), seeking past the end is allowed */
+        if ( (Uint32)offset > movie->mem.size ) {
+            offset = movie->mem.size;
+        }
+        movie->mem.pos = offset;
+        movie->mem.eof = 0;
+        return(0);
+    }
+    if ( movie->rw.ops ) {
+        if ( SDL_RWseek(movie->rw.ops, offset, whence) < 0 ) {
+            return(-1);
+        }
+        movie->rw.eof = 0;
+        return(0);
+    }
+    return(fseek(movie->src, offset, whence));
+}
+
+static Uint32 src_tell(SMJPEG *movie)
+{
+    if ( movie->mem.base ) {
+        return(movie->mem.pos);
+    }
+    if ( movie->rw.ops ) {
+        return(SDL_RWtell(movie->rw.ops));
+    }
+    return(ftell(movie->src));
+}
+
+static int src_eof(SMJPEG *movie)
+{
+    if ( movie->mem.base ) {
+        return(movie->mem.eof);
+    }
+    if ( movie->rw.ops ) {
+        return(movie->rw.eof);
+    }
+    return(feof(movie->src));
+}
+
+static void src_close(SMJPEG *movie)
+{
+    if ( movie->mem.base ) {
+#ifdef HAVE_MMAP
+        if ( movie->mem.mapped ) {
+            munmap((void *)movie->mem.base, movie->mem.size);
+        }
+#endif
+        if ( movie->mem.allocated ) {
+            free((void *)movie->mem.base);
+        }
+        movie->mem.base = NULL;
+    }
+    if ( movie->rw.ops ) {
+        if ( movie->rw.freesrc ) {
+            SDL_RWclose(movie->rw.ops);
+        }
+        movie->rw.ops = NULL;
+    }
+    if ( movie->src ) {
+        fclose(movie->src);
+        movie->src = NULL;
+    }
+}
+
 /* Called by jpeg_read_header before any data is actually read */
 static void jpegsrc_init (j_decompress_ptr cinfo)
 {
@@ -67,7 +276,7 @@ static int jpegsrc_fill (j_decompress_ptr cinfo)
     if ( length > src->length ) {
         length = src->length;
     }
-    if ( ! fread(src->buffer, length, 1, src->stream) ) {
+    if ( length && ! src_read(src->movie, src->buffer, length) ) {
         /* Uh oh.. */
         SMJPEG_status(src->movie, -1, "Truncated SMJPEG file - aborting.");
         return(FALSE);
@@ -117,11 +326,9 @@ static void jpegsrc_quit (j_decompress_ptr cinfo)
     return;
 }
 
-static void jpeg_smjpeg_src (j_decompress_ptr cinfo, SMJPEG *movie)
+static void jpeg_smjpeg_src (j_decompress_ptr cinfo, SMJPEG *movie,
+                             struct smjpeg_source_mgr *src)
 {
-    struct smjpeg_source_mgr *src;
-
-    src = &movie->jpeg_srcmgr;
     cinfo->src = (struct jpeg_source_mgr *)src;
     src->movie = movie;
     src->pub.init_source = jpegsrc_init;
@@ -129,67 +336,134 @@ static void jpeg_smjpeg_src (j_decompress_ptr cinfo, SMJPEG *movie)
     src->pub.skip_input_data = jpegsrc_skip;
     src->pub.resync_to_restart = jpeg_resync_to_restart; /* default method */
     src->pub.term_source = jpegsrc_quit;
-    src->stream = movie->src;
     src->pub.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
     src->pub.next_input_byte = NULL; /* until buffer loaded */
 }
 
+/* Background decoding, see SMJPEG_queue() */
+static int SMJPEG_startqueue(SMJPEG *movie);
+static void SMJPEG_stopqueue(SMJPEG *movie);
+static void SMJPEG_freequeue(SMJPEG *movie);
+
 void SMJPEG_free(SMJPEG *movie)
 {
-    if ( movie->src ) {
-        fclose(movie->src);
-        movie->src = NULL;
-    }
+    SMJPEG_stopqueue(movie);
+    SMJPEG_freequeue(movie);
+    src_close(movie);
     if ( movie->video.target_rows ) {
         free(movie->video.target_rows);
         movie->video.target_rows = NULL;
     }
-    SDL_DestroyMutex(movie->audio.ring.audio_mutex);
+    if ( movie->index.entry ) {
+        free(movie->index.entry);
+        movie->index.entry = NULL;
+    }
+    if ( movie->jpeg_srcmgr.frame ) {
+        free(movie->jpeg_srcmgr.frame);
+        movie->jpeg_srcmgr.frame = NULL;
+    }
+    if ( movie->audio.ring.buf ) {
+        free(movie->audio.ring.buf);
+        movie->audio.ring.buf = NULL;
+    }
+    if ( movie->audio.ring.wake ) {
+        SDL_DestroySemaphore(movie->audio.ring.wake);
+    }
+    if ( movie->queue.lock ) {
+        SDL_DestroyMutex(movie->queue.lock);
+        SDL_DestroyCond(movie->queue.cond);
+    }
 }
 
-int SMJPEG_load(SMJPEG *movie, const char *file)
+/* Private function to load the index block written by the encoder
+   - the whole block is fetched with a single read
+ */
+static int SMJPEG_loadindex(SMJPEG *movie, Uint32 offset, Uint32 length)
+{
+    struct smjpeg_index_entry *entry;
+    Uint8 *block, *data;
+    Uint32 entries;
+    Uint32 i;
+
+    if ( length < 12 ) {
+        return(-1);
+    }
+    block = (Uint8 *)malloc(length);
+    if ( block == NULL ) {
+        return(-1);
+    }
+    if ( (src_seek(movie, offset, SEEK_SET) < 0) ||
+         ! src_read(movie, block, length) ||
+         ! MAGIC_EQUALS(block, INDEX_DATA_MAGIC) ) {
+        free(block);
+        return(-1);
+    }
+    entries = GET32(&block[4]);
+    if ( entries == 0 || entries > (length - 12) / 16 ) {
+        free(block);
+        return(-1);
+    }
+    movie->index.entry = (struct smjpeg_index_entry *)
+                         malloc(entries*sizeof(*movie->index.entry));
+    if ( movie->index.entry == NULL ) {
+        free(block);
+        return(-1);
+    }
+    movie->index.entries = entries;
+    movie->index.data_end = GET32(&block[8]);
+
+    data = &block[12];
+    for ( i = 0; i < entries; ++i ) {
+        entry = &movie->index.entry[i];
+        entry->timestamp = GET32(&data[0]);
+        entry->offset = GET32(&data[4]);
+        entry->chunk = GET32(&data[8]);
+        entry->length = GET32(&data[12]);
+        entry->frame = movie->video.frames ? i : 0;
+        data += 16;
+    }
+    free(block);
+    return(0);
+}
+
+/* Private function to load the SMJPEG header from the data source */
+static int SMJPEG_loadheader(SMJPEG *movie, const char *file)
 {
     const Uint8 smjpeg_magic[] = { '\0', '\n', 'S','M','J','P','E','G' };
     Uint32 version;
     Uint8 buffer[BUFSIZ];
     Uint32 length;
-
-    /* Clear everything out */
-    memset(movie, 0, (sizeof *movie));
-
-    /* Open the SMJPEG file */
-    movie->src = fopen(file, "rb");
-    if ( movie->src == NULL ) {
-        SMJPEG_status(movie,-1, "Couldn't open %s: %s", file, strerror(errno));
-        goto error_return;
-    }
+    Uint32 index_offset;
+    Uint32 index_length;
 
     /* Load the SMJPEG header */
-    if ( ! fread(buffer, sizeof(smjpeg_magic), 1, movie->src) ||
+    if ( ! src_read(movie, buffer, sizeof(smjpeg_magic)) ||
          (memcmp(buffer, smjpeg_magic, (sizeof smjpeg_magic)) != 0) ) {
         SMJPEG_status(movie, -1, "%s is not an SMJPEG animation", file);
-        goto error_return;
+        return(-1);
     }
-    READ32(version, movie->src);
+    version = src_read32(movie);
     if ( version != SMJPEG_FORMAT_VERSION ) {
         SMJPEG_status(movie, -1, "Unknown SMJPEG file version (%d)", version);
-        goto error_return;
+        return(-1);
     }
-    READ32(movie->length, movie->src);
+    movie->length = src_read32(movie);
 
     /* Load additional media headers */
+    index_offset = 0;
+    index_length = 0;
     do {
-        if ( ! fread(buffer, 4, 1, movie->src) ) {
+        if ( ! src_read(movie, buffer, 4) ) {
             SMJPEG_status(movie, -1, "Short read while loading header");
-            goto error_return;
+            return(-1);
         }
         if ( MAGIC_EQUALS(buffer, AUDIO_HEADER_MAGIC) ) {
-            READ32(length, movie->src);
+            length = src_read32(movie);
             movie->audio.enabled = 1;
-            READ16(movie->audio.rate, movie->src);
-            READ8(movie->audio.bits, movie->src);
-            READ8(movie->audio.channels, movie->src);
-            fread(movie->audio.encoding, 4, 1, movie->src);
+            movie->audio.rate = src_read16(movie);
+            movie->audio.bits = src_read8(movie);
+            movie->audio.channels = src_read8(movie);
+            src_read(movie, movie->audio.encoding, 4);
             if ( ! MAGIC_EQUALS(movie->audio.encoding, AUDIO_ENCODING_NONE) &&
                  ! MAGIC_EQUALS(movie->audio.encoding, AUDIO_ENCODING_ADPCM) ) {
                 SMJPEG_status(movie, 0,
@@ -198,16 +472,23 @@ int SMJPEG_load(SMJPEG *movie, const char *file)
                             movie->audio.encoding[2], movie->audio.encoding[3]);
                 movie->audio.enabled = 0;
             }
-        }
+        } else
         if ( MAGIC_EQUALS(buffer, VIDEO_HEADER_MAGIC) ) {
-            READ32(length, movie->src);
+            length = src_read32(movie);
             movie->video.enabled = 1;
-            READ32(movie->video.frames, movie->src);
+            movie->video.frames = src_read32(movie);
+            if ( movie->video.frames == 0 ) {
+                SMJPEG_status(movie, -1, "Video stream has no frames");
+                return(-1);
+            }
             movie->video.ms_per_frame = movie->length/movie->video.frames;
-            READ16(movie->video.width, movie->src);
-            READ16(movie->video.height, movie->src);
+            movie->video.width = src_read16(movie);
+            movie->video.height = src_read16(movie);
+            movie->video.scale = 1;
+            movie->video.out_width = movie->video.width;
+            movie->video.out_height = movie->video.height;
             movie->video.frame = 0;
-            fread(movie->video.encoding, 4, 1, movie->src);
+            src_read(movie, movie->video.encoding, 4);
             if ( ! MAGIC_EQUALS(movie->video.encoding, VIDEO_ENCODING_JPEG) ) {
                 SMJPEG_status(movie, 0,
                             "Warning: Unknown video encoding (%c%c%c%c)\n",
@@ -219,10 +500,37 @@ int SMJPEG_load(SMJPEG *movie, const char *file)
               (Uint8 **)malloc(movie->video.height*sizeof(Uint8 *));
             if ( movie->video.target_rows == NULL ) {
                 SMJPEG_status(movie, -1, "Out of memory");
-                goto error_return;
+                return(-1);
+            }
+        } else
+        if ( MAGIC_EQUALS(buffer, INDEX_HEADER_MAGIC) ) {
+            length = src_read32(movie);
+            if ( length < 8 ) {
+                SMJPEG_status(movie, -1, "Corrupt index header");
+                return(-1);
             }
+            index_offset = src_read32(movie);
+            index_length = src_read32(movie);
+            src_seek(movie, length-8, SEEK_CUR);
+        } else
+        if ( ! MAGIC_EQUALS(buffer, HEADER_END_MAGIC) ) {
+            /* Skip headers we don't know about */
+            length = src_read32(movie);
+            src_seek(movie, length, SEEK_CUR);
         }
     } while ( ! MAGIC_EQUALS(buffer, HEADER_END_MAGIC) );
+    movie->index.data_start = src_tell(movie);
+
+    /* Allocate the buffer for decoded audio */
+    if ( movie->audio.enabled &&
+         (SMJPEG_audiobuffer(movie, SMJPEG_AUDIO_BUFFER) < 0) ) {
+        return(-1);
+    }
+
+    /* Load the index, if there is one (otherwise it's built when needed) */
+    if ( index_offset ) {
+        SMJPEG_loadindex(movie, index_offset, index_length);
+    }
 
     /* Reset any other values needed for playing */
     SMJPEG_rewind(movie);
@@ -230,22 +538,152 @@ int SMJPEG_load(SMJPEG *movie, const char *file)
     /* Initialize JPEG decoder */
     movie->jpeg_cinfo.err = jpeg_std_error(&movie->jpeg_errmgr);
     jpeg_create_decompress(&movie->jpeg_cinfo);
-    jpeg_smjpeg_src(&movie->jpeg_cinfo, movie);
+    jpeg_smjpeg_src(&movie->jpeg_cinfo, movie, &movie->jpeg_srcmgr);
 
     /* Perform fast decoding */
     movie->jpeg_cinfo.dct_method = JDCT_FASTEST;
     movie->jpeg_cinfo.do_fancy_upsampling = FALSE;
 
-    movie->audio.ring.audio_mutex = SDL_CreateMutex();
-
     /* Successful header load! */
     return(0);
+}
 
-error_return:
-    if ( movie->src ) {
-        fclose(movie->src);
+int SMJPEG_load(SMJPEG *movie, const char *file)
+{
+    /* Clear everything out */
+    memset(movie, 0, (sizeof *movie));
+
+    /* Open the SMJPEG file */
+    movie->src = fopen(file, "rb");
+    if ( movie->src == NULL ) {
+        SMJPEG_status(movie,-1, "Couldn't open %s: %s", file, strerror(errno));
+        return(-1);
+    }
+    if ( SMJPEG_loadheader(movie, file) < 0 ) {
+        src_close(movie);
+        return(-1);
+    }
+    return(0);
+}
+
+/* Load an SMJPEG animation held in memory
+   - the memory must stay valid until SMJPEG_free() is called, and
+     frames are decoded from it in place.
+ */
+int SMJPEG_load_mem(SMJPEG *movie, const void *data, size_t size)
+{
+    /* Clear everything out */
+    memset(movie, 0, (sizeof *movie));
+
+    if ( SIZE_OVER_32BITS(size) ) {
+        SMJPEG_status(movie, -1, "Memory buffer is too large");
+        return(-1);
+    }
+    movie->mem.base = (const Uint8 *)data;
+    movie->mem.size = size;
+    if ( SMJPEG_loadheader(movie, "Memory buffer") < 0 ) {
+        src_close(movie);
+        return(-1);
+    }
+    return(0);
+}
+
+/* Load an SMJPEG animation through an SDL_RWops data source */
+int SMJPEG_load_rw(SMJPEG *movie, SDL_RWops *src, int freesrc)
+{
+    /* Clear everything out */
+    memset(movie, 0, (sizeof *movie));
+
+    movie->rw.ops = src;
+    movie->rw.freesrc = freesrc;
+    if ( SMJPEG_loadheader(movie, "RWops data source") < 0 ) {
+        src_close(movie);
+        return(-1);
+    }
+    return(0);
+}
+
+/* Load an SMJPEG file by mapping it into memory
+   - chunk headers are parsed straight from the mapping, and the JPEG
+     decoder reads each frame in place without copying it.
+ */
+int SMJPEG_load_mmap(SMJPEG *movie, const char *file)
+{
+#ifdef HAVE_MMAP
+    struct stat sb;
+    void *base;
+    int fd;
+#else
+    FILE *fp;
+    Uint8 *base;
+    long size;
+#endif
+
+    /* Clear everything out */
+    memset(movie, 0, (sizeof *movie));
+
+#ifdef HAVE_MMAP
+    fd = open(file, O_RDONLY);
+    if ( fd < 0 ) {
+        SMJPEG_status(movie,-1, "Couldn't open %s: %s", file, strerror(errno));
+        return(-1);
+    }
+    if ( fstat(fd, &sb) < 0 ) {
+        SMJPEG_status(movie,-1, "Couldn't stat %s: %s", file, strerror(errno));
+        close(fd);
+        return(-1);
+    }
+    if ( SIZE_OVER_32BITS(sb.st_size) ) {
+        SMJPEG_status(movie,-1, "%s is too large to map", file);
+        close(fd);
+        return(-1);
+    }
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( base == MAP_FAILED ) {
+        SMJPEG_status(movie,-1, "Couldn't map %s: %s", file, strerror(errno));
+        return(-1);
+    }
+    movie->mem.base = (const Uint8 *)base;
+    movie->mem.size = sb.st_size;
+    movie->mem.mapped = 1;
+#else
+    /* No mmap() on this platform, read the whole file instead */
+    fp = fopen(file, "rb");
+    if ( fp == NULL ) {
+        SMJPEG_status(movie,-1, "Couldn't open %s: %s", file, strerror(errno));
+        return(-1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if ( (size < 0) || SIZE_OVER_32BITS(size) ) {
+        SMJPEG_status(movie,-1, "%s is too large to load", file);
+        fclose(fp);
+        return(-1);
+    }
+    base = (Uint8 *)malloc(size ? size : 1);
+    if ( base == NULL ) {
+        SMJPEG_status(movie, -1, "Out of memory");
+        fclose(fp);
+        return(-1);
+    }
+    if ( size && ! fread(base, size, 1, fp) ) {
+        SMJPEG_status(movie, -1, "Couldn't read %s", file);
+        free(base);
+        fclose(fp);
+        return(-1);
     }
-    return(-1);
+    fclose(fp);
+    movie->mem.base = base;
+    movie->mem.size = size;
+    movie->mem.allocated = 1;
+#endif
+    if ( SMJPEG_loadheader(movie, file) < 0 ) {
+        src_close(movie);
+        return(-1);
+    }
+    return(0);
 }
 
 /* Turn on or off pixel doubling for SMJPEG display.
@@ -256,6 +694,26 @@ void SMJPEG_double(SMJPEG *movie, int state)
     movie->video.doubled = state;
 }
 
+/* Decode the video at a fraction of its size, using the reduced size
+   inverse DCTs of the JPEG library.
+   You must call SMJPEG_target() after you call this function.
+ */
+int SMJPEG_set_scale(SMJPEG *movie, int scale)
+{
+    if ( (scale != 1) && (scale != 2) && (scale != 4) && (scale != 8) ) {
+        SMJPEG_status(movie, -1, "Scale must be 1, 2, 4 or 8");
+        return(-1);
+    }
+    /* Frames decoded ahead were decoded at the old size */
+    SMJPEG_stopqueue(movie);
+    SMJPEG_freequeue(movie);
+
+    movie->video.scale = scale;
+    movie->video.out_width = (movie->video.width + scale-1) / scale;
+    movie->video.out_height = (movie->video.height + scale-1) / scale;
+    return(0);
+}
+
 /* Set the target display for video playback of an SMJPEG video */
 int SMJPEG_target(SMJPEG *movie,
        SDL_mutex *lock, int x, int y, SDL_Surface *target,
@@ -263,9 +721,10 @@ int SMJPEG_target(SMJPEG *movie,
 {
     int row;
     int pitch;
+    int running;
 
-    if ( ((x+movie->video.width) > target->w) ||
-         ((y+movie->video.height) > target->h) ) {
+    if ( ((x+movie->video.out_width) > target->w) ||
+         ((y+movie->video.out_height) > target->h) ) {
         SMJPEG_status(movie, -1, "Target area not within target surface");
         return(-1);
     }
@@ -310,10 +769,39 @@ int SMJPEG_target(SMJPEG *movie,
                 }
                 break;
             }
+            SMJPEG_status(movie, -1, "Unsupported target color format");
+            return(-1);
+        case 32:
+            if ( (target->format->Rmask == 0xFF0000) &&
+                 (target->format->Gmask == 0x00FF00) &&
+                 (target->format->Bmask == 0x0000FF) ) {
+                if ( movie->video.doubled ) {
+                    movie->jpeg_colorspace = JCS_XRGB32_DBL;
+                } else {
+                    movie->jpeg_colorspace = JCS_XRGB32;
+                }
+                break;
+            }
+            if ( (target->format->Rmask == 0x0000FF) &&
+                 (target->format->Gmask == 0x00FF00) &&
+                 (target->format->Bmask == 0xFF0000) ) {
+                if ( movie->video.doubled ) {
+                    movie->jpeg_colorspace = JCS_XBGR32_DBL;
+                } else {
+                    movie->jpeg_colorspace = JCS_XBGR32;
+                }
+                break;
+            }
+            SMJPEG_status(movie, -1, "Unsupported target color format");
+            return(-1);
         default:
             SMJPEG_status(movie, -1, "Unsupported target color format");
             return(-1);
     }
+    /* Frames decoded ahead were decoded for the old target */
+    running = (movie->queue.thread != NULL);
+    SMJPEG_stopqueue(movie);
+
     movie->video.target = target;
     movie->video.target_lock = lock;
     movie->video.target_x = x;
@@ -325,134 +813,426 @@ int SMJPEG_target(SMJPEG *movie,
     } else {
         pitch = target->pitch;
     }
-    for ( row=1; row<movie->video.height; ++row ) {
+    for ( row=1; row<movie->video.out_height; ++row ) {
         movie->video.target_rows[row] = movie->video.target_rows[row-1] + pitch;
     }
     movie->video.target_update = update;
 
+    if ( running ) {
+        return(SMJPEG_startqueue(movie));
+    }
     return(0);
 }
 
-/* Private function to display a frame of JFIF encoded animation
-   - the FILE pointer is assumed to be at the start of a jpeg frame
+/* Private function to run a JPEG decompressor over a whole frame
+   - doubled formats also store each row dup bytes below it, if not 0
  */
-static void SMJPEG_displayJFIF(SMJPEG *movie)
+static void SMJPEG_decompress(SMJPEG *movie,
+            struct jpeg_decompress_struct *cinfo, Uint8 **rows, int dup)
 {
-    struct jpeg_decompress_struct *cinfo;
-
-    /* Initialize the source manager */
-    READ32(movie->jpeg_srcmgr.length, movie->src);
-    movie->jpeg_srcmgr.pub.bytes_in_buffer = 0;
-    movie->jpeg_srcmgr.pub.next_input_byte = NULL;
-
-    /* Skip the video frame if video is not enabled */
-    if ( ! movie->video.enabled ) {
-        fseek(movie->src, movie->jpeg_srcmgr.length, SEEK_CUR);
-        return;
-    }
-
     /* Start the decompression engine */
-    cinfo = &movie->jpeg_cinfo;
     jpeg_read_header(cinfo, TRUE);
     cinfo->dct_method = JDCT_IFAST;
     cinfo->out_color_space = movie->jpeg_colorspace;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = movie->video.scale;
+    cinfo->dbl_row_offset = dup;
 
-    /* Lock the display target, if necessary */
-    if ( movie->video.target_lock ) {
-        SDL_mutexP(movie->video.target_lock);
-    }
-
-    /* Decompress to the target surface */
+    /* Decompress to the output rows */
     jpeg_start_decompress(cinfo);
     while ( cinfo->output_scanline < cinfo->output_height ) {
-        jpeg_read_scanlines(cinfo,
-                        &movie->video.target_rows[cinfo->output_scanline],
+        jpeg_read_scanlines(cinfo, &rows[cinfo->output_scanline],
                                 cinfo->output_height-cinfo->output_scanline);
     }
-    if ( movie->video.doubled ) {
-        int row;
-
-        for ( row=0; row < movie->video.height; ++row ) {
-            memcpy(movie->video.target_rows[row]+movie->video.target->pitch,
-                movie->video.target_rows[row], movie->video.target->pitch);
-        }
-    }
     jpeg_finish_decompress(cinfo);
+}
 
-    /* Update the screen */
-    if ( movie->video.target_update ) {
-        if ( movie->video.doubled ) {
-            movie->video.target_update(movie->video.target,
-                               movie->video.target_x, movie->video.target_y,
-                               2*cinfo->output_width, 2*cinfo->output_height);
-        } else {
-            movie->video.target_update(movie->video.target,
+/* Private function to run a JPEG decompressor over a whole 4:2:0 frame,
+   writing the Y, Cb and Cr planes without upsampling or color conversion
+   - rows go straight to a plane when its pitch leaves room for the
+     padding the inverse DCT writes, and through a bounce row otherwise
+ */
+static int SMJPEG_decompress_yuv(SMJPEG *movie,
+                        struct jpeg_decompress_struct *cinfo,
+                        Uint8 **planes, int *pitches)
+{
+    jpeg_component_info *comp;
+    JSAMPROW rowbuf[3][2*DCTSIZE];
+    JSAMPARRAY data[3];
+    JSAMPARRAY bounce[3];
+    JDIMENSION lines;
+    JDIMENSION padded;
+    int rows[3];
+    int first, c, row;
+
+    /* Start the decompression engine */
+    jpeg_read_header(cinfo, TRUE);
+    comp = cinfo->comp_info;
+    if ( (cinfo->jpeg_color_space != JCS_YCbCr) ||
+         (cinfo->num_components != 3) ||
+         (comp[0].h_samp_factor != 2) || (comp[0].v_samp_factor != 2) ||
+         (comp[1].h_samp_factor != 1) || (comp[1].v_samp_factor != 1) ||
+         (comp[2].h_samp_factor != 1) || (comp[2].v_samp_factor != 1) ) {
+        jpeg_abort_decompress(cinfo);
+        SMJPEG_status(movie, -1, "Frame isn't 4:2:0 YCbCr");
+        return(-1);
+    }
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->raw_data_out = TRUE;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = movie->video.scale;
+    jpeg_start_decompress(cinfo);
+
+    /* Each call returns one row of MCUs: 16 rows of Y and 8 of Cb and Cr
+       at full size, with every row padded out to whole DCT blocks.
+     */
+    lines = cinfo->max_v_samp_factor * cinfo->min_DCT_scaled_size;
+    for ( c=0; c<3; ++c ) {
+        comp = &cinfo->comp_info[c];
+        rows[c] = comp->v_samp_factor * comp->DCT_scaled_size;
+        bounce[c] = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo,
+                        JPOOL_IMAGE,
+                        comp->width_in_blocks * comp->DCT_scaled_size,
+                        rows[c]);
+        data[c] = rowbuf[c];
+    }
+    while ( cinfo->output_scanline < cinfo->output_height ) {
+        for ( c=0; c<3; ++c ) {
+            comp = &cinfo->comp_info[c];
+            padded = comp->width_in_blocks * comp->DCT_scaled_size;
+            first = (cinfo->output_scanline / lines) * rows[c];
+            for ( row=0; row<rows[c]; ++row ) {
+                if ( (first+row < (int)comp->downsampled_height) &&
+                     (pitches[c] >= (int)padded) ) {
+                    rowbuf[c][row] = planes[c] + (first+row)*pitches[c];
+                } else {
+                    rowbuf[c][row] = bounce[c][row];
+                }
+            }
+        }
+        jpeg_read_raw_data(cinfo, data, lines);
+        for ( c=0; c<3; ++c ) {
+            comp = &cinfo->comp_info[c];
+            first = (cinfo->output_scanline / lines - 1) * rows[c];
+            for ( row=0; (row < rows[c]) &&
+                         (first+row < (int)comp->downsampled_height); ++row ) {
+                if ( rowbuf[c][row] == bounce[c][row] ) {
+                    memcpy(planes[c] + (first+row)*pitches[c],
+                           bounce[c][row], comp->downsampled_width);
+                }
+            }
+        }
+    }
+    jpeg_finish_decompress(cinfo);
+    return(0);
+}
+
+/* Private function to set up the JPEG data source for a frame
+   - the data source is assumed to be at the start of the jpeg data
+ */
+static void SMJPEG_sourceJFIF(SMJPEG *movie, Uint32 length)
+{
+    Uint8 *buffer;
+
+    /* Initialize the source manager */
+    movie->jpeg_srcmgr.length = length;
+    movie->jpeg_srcmgr.pub.bytes_in_buffer = 0;
+    movie->jpeg_srcmgr.pub.next_input_byte = NULL;
+
+    /* Frames in memory are handed to the JPEG decoder in place */
+    if ( movie->mem.base ) {
+        length = movie->mem.size - movie->mem.pos;
+        if ( length > movie->jpeg_srcmgr.length ) {
+            length = movie->jpeg_srcmgr.length;
+        }
+        movie->jpeg_srcmgr.pub.next_input_byte =
+                                    movie->mem.base + movie->mem.pos;
+        movie->jpeg_srcmgr.pub.bytes_in_buffer = length;
+        movie->jpeg_srcmgr.length = 0;
+        movie->mem.pos += length;
+        return;
+    }
+
+    /* Other frames are read whole, so the Huffman decoder can use its
+       fast path, which needs a good part of a kilobyte per block in the
+       buffer.  The frame is read in pieces if it can't be held.
+     */
+    if ( length > movie->jpeg_srcmgr.maxlen ) {
+        buffer = (Uint8 *)realloc(movie->jpeg_srcmgr.frame, length);
+        if ( buffer == NULL ) {
+            return;
+        }
+        movie->jpeg_srcmgr.frame = buffer;
+        movie->jpeg_srcmgr.maxlen = length;
+    }
+    if ( ! src_read(movie, movie->jpeg_srcmgr.frame, length) ) {
+        SMJPEG_status(movie, -1, "Truncated SMJPEG file - aborting.");
+        movie->jpeg_srcmgr.length = 0;
+        return;
+    }
+    movie->jpeg_srcmgr.pub.next_input_byte = movie->jpeg_srcmgr.frame;
+    movie->jpeg_srcmgr.pub.bytes_in_buffer = length;
+    movie->jpeg_srcmgr.length = 0;
+}
+
+/* Private function to skip any frame data the JPEG decoder didn't need */
+static void SMJPEG_skipJFIF(SMJPEG *movie)
+{
+    if ( movie->jpeg_srcmgr.length > 0 ) {
+        src_seek(movie, movie->jpeg_srcmgr.length, SEEK_CUR);
+        movie->jpeg_srcmgr.length = 0;
+    }
+}
+
+/* Private function to decode a frame of JFIF encoded animation
+   - the data source is assumed to be at the start of the jpeg data
+ */
+static void SMJPEG_decodeJFIF(SMJPEG *movie, Uint32 length, Uint8 **rows,
+                              int dup)
+{
+    SMJPEG_sourceJFIF(movie, length);
+    SMJPEG_decompress(movie, &movie->jpeg_cinfo, rows, dup);
+    SMJPEG_skipJFIF(movie);
+}
+
+/* Private function to tell the application the target has been updated */
+static void SMJPEG_update(SMJPEG *movie)
+{
+    if ( movie->video.target_update ) {
+        if ( movie->video.doubled ) {
+            movie->video.target_update(movie->video.target,
+                               movie->video.target_x, movie->video.target_y,
+                               2*movie->video.out_width,
+                               2*movie->video.out_height);
+        } else {
+            movie->video.target_update(movie->video.target,
                                movie->video.target_x, movie->video.target_y,
-                               cinfo->output_width, cinfo->output_height);
+                               movie->video.out_width,
+                               movie->video.out_height);
         }
     }
+}
+
+/* Private function to display a frame of JFIF encoded animation
+   - the data source is assumed to be at the start of a jpeg frame
+ */
+static void SMJPEG_displayJFIF(SMJPEG *movie)
+{
+    Uint32 length;
+    Uint32 ticks;
+    int elapsed;
+
+    length = src_read32(movie);
+
+    /* Skip the video frame if video is not enabled */
+    if ( ! movie->video.enabled ) {
+        src_seek(movie, length, SEEK_CUR);
+        return;
+    }
+
+    /* Lock the display target, if necessary */
+    if ( movie->video.target_lock ) {
+        SDL_mutexP(movie->video.target_lock);
+    }
+
+    /* Decompress to the target surface */
+    ticks = SDL_GetTicks();
+    if ( movie->video.doubled ) {
+        SMJPEG_decodeJFIF(movie, length, movie->video.target_rows,
+                          movie->video.target->pitch);
+    } else {
+        SMJPEG_decodeJFIF(movie, length, movie->video.target_rows, 0);
+    }
+
+    /* Update the screen */
+    SMJPEG_update(movie);
 
     /* Unlock the display target, if necessary */
     if ( movie->video.target_lock ) {
         SDL_mutexV(movie->video.target_lock);
     }
+
+    /* Keep a moving average of the time taken, weighting this frame 1/8 */
+    elapsed = (SDL_GetTicks() - ticks) << 4;
+    if ( movie->video.cost ) {
+        movie->video.cost += (elapsed - (int)movie->video.cost) / 8;
+    } else {
+        movie->video.cost = elapsed;
+    }
+}
+
+/* Private function to build the chunk index used for seeking
+   - each entry is a group of chunks ending with a video chunk,
+     or a single audio chunk if the stream has no video.
+ */
+static int SMJPEG_buildindex(SMJPEG *movie)
+{
+    struct smjpeg_index_entry *entry;
+    int allocated;
+    Uint8 magic[4];
+    Uint32 timestamp;
+    Uint32 length;
+    Uint32 offset;
+    Uint32 group;
+    Uint32 frame;
+    long saved;
+
+    /* Allocate enough room for all the video frames we know about */
+    allocated = movie->video.frames + 1;
+    movie->index.entry = (struct smjpeg_index_entry *)
+                         malloc(allocated*sizeof(*movie->index.entry));
+    if ( movie->index.entry == NULL ) {
+        SMJPEG_status(movie, -1, "Out of memory");
+        return(-1);
+    }
+    movie->index.entries = 0;
+
+    /* Walk the data chunks once, recording where each group starts */
+    saved = src_tell(movie);
+    offset = movie->index.data_start;
+    group = offset;
+    frame = 0;
+    src_seek(movie, offset, SEEK_SET);
+    while ( src_read(movie, magic, 4) &&
+            ! MAGIC_EQUALS(magic, DATA_END_MAGIC) ) {
+        timestamp = src_read32(movie);
+        length = src_read32(movie);
+        if ( src_eof(movie) ) {
+            break;
+        }
+        offset += 12 + length;
+
+        if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ||
+             (MAGIC_EQUALS(magic, AUDIO_DATA_MAGIC) && !movie->video.frames) ) {
+            if ( movie->index.entries == allocated ) {
+                allocated *= 2;
+                entry = (struct smjpeg_index_entry *)realloc(
+                    movie->index.entry, allocated*sizeof(*entry));
+                if ( entry == NULL ) {
+                    SMJPEG_status(movie, -1, "Out of memory");
+                    free(movie->index.entry);
+                    movie->index.entry = NULL;
+                    src_seek(movie, saved, SEEK_SET);
+                    return(-1);
+                }
+                movie->index.entry = entry;
+            }
+            entry = &movie->index.entry[movie->index.entries++];
+            entry->timestamp = timestamp;
+            entry->offset = group;
+            entry->frame = frame;
+            entry->chunk = offset - 12 - length;
+            entry->length = length;
+            if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
+                ++frame;
+            }
+            group = offset;
+        }
+        src_seek(movie, length, SEEK_CUR);
+    }
+    movie->index.data_end = group;
+    src_seek(movie, saved, SEEK_SET);
+    return(0);
+}
+
+/* Wake up anything waiting for the audio thread to drain the ring
+   - called after moving the read counter, or anything else a waiting side
+     checks.  This never blocks, so it is safe in the audio callback.
+*/
+static void SMJPEG_ringsignal(SMJPEG *movie)
+{
+    struct dataring *ring = &movie->audio.ring;
+
+    /* Pairs with the fence in SMJPEG_ringsleep() */
+    RING_FENCE();
+    if ( ring->wake && RING_LOAD(ring->waiting) ) {
+        SDL_SemPost(ring->wake);
+    }
+}
+
+/* Start or stop waiting for the audio thread
+   - once the waiting flag is set, a change made by the audio thread is
+     either seen by the caller's next check or posted to the semaphore.
+*/
+static void SMJPEG_ringsleep(SMJPEG *movie, int waiting)
+{
+    struct dataring *ring = &movie->audio.ring;
+
+    RING_STORE(ring->waiting, waiting);
+    RING_FENCE();
+
+    /* Forget wake-ups posted since the last wait */
+    if ( waiting ) {
+        while ( SDL_SemTryWait(ring->wake) == 0 )
+            ;
+    }
+}
+
+/* Return the number of bytes of audio queued and not thrown away */
+static Uint32 SMJPEG_audioqueued(SMJPEG *movie)
+{
+    struct dataring *ring = &movie->audio.ring;
+    Uint32 read = RING_LOAD(ring->read);
+    Uint32 flush = RING_LOAD(ring->flush);
+
+    if ( (Sint32)(flush - read) > 0 ) {
+        read = flush;
+    }
+    return(RING_LOAD(ring->write) - read);
+}
+
+/* Throw away the queued audio, e.g. when seeking
+   - the audio thread skips it the next time it asks for data.
+*/
+static void SMJPEG_flushaudio(SMJPEG *movie)
+{
+    RING_STORE(movie->audio.ring.flush, RING_LOAD(movie->audio.ring.write));
+    movie->audio.queued = 0;
+    SMJPEG_ringsignal(movie);
 }
 
 /* Seek to a particular offset in the MJPEG stream
-   - we take the easy route and seek from the beginning
+   - we position the stream at the start of the last chunk group
+     whose timestamp is not later than the requested time.
 */
 int SMJPEG_seek(SMJPEG *movie, Uint32 ms)
 {
-    Uint8 magic[8];
-    Uint32 length;
+    struct smjpeg_index_entry *entry;
+    Uint32 offset;
+    int lo, hi, mid;
 
-    /* Seek to the beginning */
-    movie->audio.ring.used = 0;
+    /* Stop any current playback, throwing away the queued audio */
+    SMJPEG_stopqueue(movie);
+    SMJPEG_flushaudio(movie);
     SMJPEG_stop(movie);
-    if ( fseek(movie->src, 0, SEEK_SET) < 0 ) {
-        return(-1);
-    }
     movie->current = 0;
     movie->video.frame = 0;
 
-    /* Skip SMJPEG header */
-    fread(magic, 8, 1, movie->src);
-    READ32(length, movie->src);
-    READ32(length, movie->src);
-    do {
-        if ( fread(magic, 4, 1, movie->src) ) {
-            if ( ! MAGIC_EQUALS(magic, HEADER_END_MAGIC) ) {
-                READ32(length, movie->src);
-                fseek(movie->src, length, SEEK_CUR);
-            }
-        }
-    } while ( !feof(movie->src) && ! MAGIC_EQUALS(magic, HEADER_END_MAGIC) );
-
-    /* Seek to the proper time offset */
-    length = 0;
-    movie->at_end = 0;
-    do {
-        /* Seek past last chunk */
-        if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
-            ++movie->video.frame;
+    /* Find the chunk group to start with */
+    offset = movie->index.data_start;
+    if ( ms > 0 ) {
+        if ( !movie->index.entry && (SMJPEG_buildindex(movie) < 0) ) {
+            return(-1);
         }
-        fseek(movie->src, length, SEEK_CUR);
-
-        /* Read magic, timestamp, and chunk length */
-        if ( fread(magic, 4, 1, movie->src) ) {
-            if ( MAGIC_EQUALS(magic, DATA_END_MAGIC) ) {
-                /* Back up so it will be read again */
-                fseek(movie->src, -4, SEEK_CUR);
+        lo = 0;
+        hi = movie->index.entries;
+        while ( lo < hi ) {
+            mid = (lo + hi) / 2;
+            if ( movie->index.entry[mid].timestamp <= ms ) {
+                lo = mid + 1;
             } else {
-                READ32(movie->current, movie->src);
-                READ32(length, movie->src);
+                hi = mid;
             }
         }
-    } while ( !END_OF_STREAM(movie, magic) && (ms < movie->current) );
-
-    /* If we haven't reached end, we need to back up to start of chunk */
-    if ( !END_OF_STREAM(movie, magic) ) {
-        fseek(movie->src, -12, SEEK_CUR);
+        if ( lo > 0 ) {
+            entry = &movie->index.entry[lo-1];
+            offset = entry->offset;
+            movie->current = entry->timestamp;
+            movie->video.frame = entry->frame;
+        }
+    }
+    if ( src_seek(movie, offset, SEEK_SET) < 0 ) {
+        return(-1);
     }
     movie->at_end = 1;
 
@@ -460,6 +1240,36 @@ int SMJPEG_seek(SMJPEG *movie, Uint32 ms)
     return(0);
 }
 
+/* Seek to the chunk group holding a particular video frame
+   - frames are counted from 0, and each has its own index entry.
+*/
+int SMJPEG_seek_frame(SMJPEG *movie, Uint32 frame)
+{
+    struct smjpeg_index_entry *entry;
+
+    /* Stop any current playback, throwing away the queued audio */
+    SMJPEG_stopqueue(movie);
+    SMJPEG_flushaudio(movie);
+    SMJPEG_stop(movie);
+
+    if ( !movie->index.entry && (SMJPEG_buildindex(movie) < 0) ) {
+        return(-1);
+    }
+    if ( !movie->video.frames || (frame >= (Uint32)movie->index.entries) ) {
+        SMJPEG_status(movie, -1, "No frame %u in the stream", frame);
+        return(-1);
+    }
+
+    entry = &movie->index.entry[frame];
+    if ( src_seek(movie, entry->offset, SEEK_SET) < 0 ) {
+        return(-1);
+    }
+    movie->current = entry->timestamp;
+    movie->video.frame = entry->frame;
+    movie->at_end = 1;
+    return(0);
+}
+
 /* Rewind to the start of an MJPEG stream */
 void SMJPEG_rewind(SMJPEG *movie)
 {
@@ -471,20 +1281,65 @@ void SMJPEG_start(SMJPEG *movie, int use_timing)
 {
     movie->use_timing = use_timing;
     if ( use_timing ) {
-        movie->start = (Sint32)SDL_GetTicks();
+        movie->start = (Sint32)(SDL_GetTicks() - movie->current);
     }
     movie->at_end = 0;
+
+    /* Start decoding ahead, if requested */
+    SMJPEG_stopqueue(movie);
+    SMJPEG_startqueue(movie);
 }
 
 /* Functions for saving the current position and restoring it */
 Uint32 SMJPEG_getposition(SMJPEG *movie)
 {
-    return ftell(movie->src);
+    Uint32 pos;
+
+    /* The decoding thread reads ahead of the frame being displayed */
+    if ( movie->queue.thread ) {
+        SDL_mutexP(movie->queue.lock);
+        if ( movie->queue.used ) {
+            pos = movie->queue.slot[movie->queue.head].offset;
+        } else {
+            pos = movie->queue.offset;
+        }
+        SDL_mutexV(movie->queue.lock);
+        return(pos);
+    }
+    return src_tell(movie);
 }
 void SMJPEG_setposition(SMJPEG *movie, Uint32 pos)
 {
-    fseek(movie->src, pos, SEEK_SET);
+    struct smjpeg_index_entry *entry;
+    int lo, hi, mid;
+
+    SMJPEG_stopqueue(movie);
+
+    /* Restore the frame count and time for the group containing pos */
+    if ( movie->index.entry || (SMJPEG_buildindex(movie) == 0) ) {
+        lo = 0;
+        hi = movie->index.entries;
+        while ( lo < hi ) {
+            mid = (lo + hi) / 2;
+            if ( movie->index.entry[mid].offset <= pos ) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if ( pos >= movie->index.data_end && movie->index.entries ) {
+            entry = &movie->index.entry[movie->index.entries-1];
+            movie->video.frame = movie->video.frames;
+            movie->current = entry->timestamp;
+        } else if ( lo > 0 ) {
+            entry = &movie->index.entry[lo-1];
+            movie->video.frame = entry->frame;
+            movie->current = entry->timestamp;
+        }
+    }
+    src_seek(movie, pos, SEEK_SET);
     movie->at_end = 0;
+    movie->audio.queued = 0;
 }
 
 static int SkipBlock(SMJPEG *movie, const char *magic)
@@ -492,83 +1347,189 @@ static int SkipBlock(SMJPEG *movie, const char *magic)
     Uint32 length;
 
     /* Skip past the body of the data chunk */
-    READ32(length, movie->src);
-    fseek(movie->src, length, SEEK_CUR);
+    length = src_read32(movie);
+    src_seek(movie, length, SEEK_CUR);
 #ifdef DEBUG_TIMING
 printf("Skipping chunk\n");
 #endif
     return(BLOCK_SKIPPED);
 }
 
-static int ParseAudio(SMJPEG *movie)
+/* Wait until the audio ring has room for len more bytes
+   - returns -1 instead if the decoding thread is being stopped, or the
+     audio has been turned off.
+*/
+static int SMJPEG_ringwait(SMJPEG *movie, Uint32 len)
 {
-    struct dataring *ring;
-    Uint32 length;
-    Uint32 extra;
-    int loop = 0;
+    struct dataring *ring = &movie->audio.ring;
 
-    /* Wait for a while if the audio buffer is full */
-    ring = &movie->audio.ring;
-    if ( ring->used == SMJPEG_AUDIO_BUFFERS ) {
+    if ( RING_SPACE(ring) < len ) {
         /* Uh oh, the audio is way behind... */
 #ifdef DEBUG_TIMING
 printf("Waiting for audio queue to empty\n");
 #endif
+        SMJPEG_ringsleep(movie, 1);
+        while ( RING_SPACE(ring) < len ) {
+            if ( !movie->audio.enabled || movie->queue.quit ) {
+                SMJPEG_ringsleep(movie, 0);
+                return(-1);
+            }
+            SDL_SemWait(ring->wake);
+        }
+        SMJPEG_ringsleep(movie, 0);
+    }
+    return(0);
+}
+
+/* Read length bytes of raw audio straight into the ring
+   - the space between the write counter and the read counter is ours
+     until the write counter is advanced past it.
+*/
+static void SMJPEG_queuepcm(SMJPEG *movie, Uint32 length)
+{
+    struct dataring *ring = &movie->audio.ring;
+    Uint32 pos, piece;
+
+    while ( length > 0 ) {
+        pos = ring->write & (ring->size-1);
+        piece = ring->size - pos;
+        if ( piece > length ) {
+            piece = length;
+        }
+        if ( SMJPEG_ringwait(movie, piece) < 0 ) {
+            break;
+        }
+        src_read(movie, &ring->buf[pos], piece);
+        RING_STORE(ring->write, ring->write+piece);
+        length -= piece;
+    }
+    if ( length > 0 ) {
+        src_seek(movie, length, SEEK_CUR);
+    }
+}
 
-        while ( (ring->used == SMJPEG_AUDIO_BUFFERS) && movie->audio.enabled ) {
-            SDL_Delay(1);
+/* Decode length bytes of ADPCM audio into the ring */
+static void SMJPEG_queueadpcm(SMJPEG *movie, struct adpcm_state *adpcm,
+                              Uint32 length)
+{
+    struct dataring *ring = &movie->audio.ring;
+    int channels = movie->audio.channels;
+    Uint8 encoded[ADPCM_PIECE];
+    short decoded[ADPCM_PIECE*2];
+    Uint32 pos, piece, bytes;
+
+    while ( length > 0 ) {
+        /* Keep to whole sample frames, so the channels stay in step */
+        piece = ADPCM_PIECE - (ADPCM_PIECE % channels);
+        if ( piece > length ) {
+            piece = length;
+        }
+        bytes = piece*4;
+        if ( SMJPEG_ringwait(movie, bytes) < 0 ) {
+            break;
         }
+        src_read(movie, encoded, piece);
 
+        pos = ring->write & (ring->size-1);
+        if ( bytes <= (ring->size - pos) ) {
+            SMJPEG_adpcm_decoder((char *)encoded, (short *)&ring->buf[pos],
+                                 piece*2, channels, adpcm);
+        } else {
+            /* This piece wraps around the end of the ring */
+            SMJPEG_adpcm_decoder((char *)encoded, decoded,
+                                 piece*2, channels, adpcm);
+            memcpy(&ring->buf[pos], decoded, ring->size - pos);
+            memcpy(ring->buf, (Uint8 *)decoded + (ring->size - pos),
+                   bytes - (ring->size - pos));
+        }
+        RING_STORE(ring->write, ring->write+bytes);
+        length -= piece;
+    }
+    if ( length > 0 ) {
+        src_seek(movie, length, SEEK_CUR);
     }
+}
 
-    SDL_mutexP(movie->audio.ring.audio_mutex);
-    /* Copy audio data into ring buffer and increment */
-    READ32(length, movie->src);
-    if ( length > SMJPEG_AUDIO_MAX_CHUNK ) {
-        /* Silently truncate overlarge chunks */
-        extra = (length-SMJPEG_AUDIO_MAX_CHUNK);
-        length = SMJPEG_AUDIO_MAX_CHUNK;
+static int ParseAudio(SMJPEG *movie, int do_wait)
+{
+    struct dataring *ring;
+    Uint32 length;
+    Uint32 header;
+    Uint32 decoded;
+    int adpcm;
+
+    ring = &movie->audio.ring;
+    length = src_read32(movie);
+    if ( !movie->audio.enabled || !ring->buf ) {
+        src_seek(movie, length, SEEK_CUR);
+        return(BLOCK_SKIPPED);
+    }
+
+    /* Skip a chunk that went into the ring before the decoding thread
+       was stopped and the stream moved back to the first unshown frame
+     */
+    if ( src_tell(movie) < movie->audio.queued ) {
+        src_seek(movie, length, SEEK_CUR);
+        return(BLOCK_SKIPPED);
+    }
+
+    /* Work out how much audio the chunk holds */
+    adpcm = MAGIC_EQUALS(movie->audio.encoding, AUDIO_ENCODING_ADPCM);
+    if ( adpcm ) {
+        header = 4 * movie->audio.channels;
+        if ( length < header ) {
+            src_seek(movie, length, SEEK_CUR);
+            return(BLOCK_SKIPPED);
+        }
+        decoded = (length - header) * 4;
     } else {
-        extra = 0;
+        header = 0;
+        decoded = length;
+    }
+
+    /* Wait for a while if the audio buffer is full
+       - the space is free once the audio thread has read past it, whether
+       it played the audio or skipped it after a flush.  A chunk bigger
+       than the whole ring goes in piece by piece as the audio plays.
+     */
+    if ( decoded > ring->size ) {
+        decoded = ring->size;
+    }
+    if ( !do_wait && (RING_SPACE(ring) < decoded) ) {
+        /* Leave the chunk for later, rather than wait for the audio */
+        src_seek(movie, -12, SEEK_CUR);
+        return(BLOCK_NOT_READY);
     }
+    if ( SMJPEG_ringwait(movie, decoded) < 0 ) {
+        if ( movie->queue.quit ) {
+            /* The decoding thread was stopped, leave the chunk for later */
+            src_seek(movie, -12, SEEK_CUR);
+            return(EARLY_RETURN);
+        }
+        src_seek(movie, length, SEEK_CUR);
+        return(BLOCK_SKIPPED);
+    }
+
     /* Handle ADPCM compressed audio data */
-    if ( MAGIC_EQUALS(movie->audio.encoding, AUDIO_ENCODING_ADPCM) ) 
-    {
-        struct adpcm_state adpcm[movie->audio.channels];
-        Uint8 unused;
-        Uint8 encoded[SMJPEG_AUDIO_MAX_CHUNK];
+    if ( adpcm ) {
+        struct adpcm_state state[movie->audio.channels];
         int i;
 
         /* Read the predictor values for this packet */
         for (i = 0; i < movie->audio.channels; i++)
         {
-            READ16(adpcm[i].valprev, movie->src);
-            READ8(adpcm[i].index, movie->src);
-            READ8(unused, movie->src);
+            state[i].valprev = src_read16(movie);
+            state[i].index = src_read8(movie);
+            src_read8(movie);
         }
 
-        /* Read the encoded data */
-        length -= (4 * movie->audio.channels);
-        fread(encoded, length, 1, movie->src);
-
         /* Decode and queue the data */
-        length *= 4;
-        ring->ringbuf[ring->write].len = length;
-        SMJPEG_adpcm_decoder(encoded, (short *)ring->ringbuf[ring->write].buf,
-                                       length/2, movie->audio.channels, &adpcm);
+        SMJPEG_queueadpcm(movie, state, length - header);
     } else {
         /* Just read the data into the queue */
-        ring->ringbuf[ring->write].len = length;
-        fread(ring->ringbuf[ring->write].buf, length, 1, movie->src);
-    }
-    ring->write = (ring->write+1)%SMJPEG_AUDIO_BUFFERS;
-    ++ring->used;
-    SDL_mutexV(movie->audio.ring.audio_mutex);
-
-    /* Seek past extra data, if we overflowed */
-    if ( extra ) {
-        fseek(movie->src, extra, SEEK_CUR);
+        SMJPEG_queuepcm(movie, length);
     }
+    movie->audio.queued = src_tell(movie);
     return(BLOCK_SKIPPED);
 }
 
@@ -582,16 +1543,19 @@ static int ParseVideo(SMJPEG *movie)
 static int ParseBlock(SMJPEG *movie, int do_wait, Uint32 timestamp)
 {
     const int TIMESLICE = 10;       /* OS timeslice, in milliseconds */
+    const int AUDIO_SLACK = 90;     /* How late audio may be, in milliseconds */
     Uint8 magic[4];
     Uint32 min_timestamp;
     Uint32 max_timestamp;
     Uint32 timenow = timestamp - movie->start;
+    Uint32 cost = 0;
+    Uint32 ready = 0;
 
     /* Read this chunk type */
-    if ( !fread(magic,4,1,movie->src) || MAGIC_EQUALS(magic,DATA_END_MAGIC) ) {
+    if ( !src_read(movie, magic, 4) || MAGIC_EQUALS(magic,DATA_END_MAGIC) ) {
         movie->at_end = 1;
-        if ( !feof(movie->src) ) {
-            fseek(movie->src, -4, SEEK_CUR);
+        if ( !src_eof(movie) ) {
+            src_seek(movie, -4, SEEK_CUR);
         }
         return(EARLY_RETURN);
     } 
@@ -602,15 +1566,36 @@ static int ParseBlock(SMJPEG *movie, int do_wait, Uint32 timestamp)
     }
 
     /* Check the timestamps, and do timing work */
-    READ32(min_timestamp, movie->src);
-    //READ32(max_timestamp, movie->src);
-    max_timestamp = min_timestamp+90;
+    min_timestamp = src_read32(movie);
+    //max_timestamp = src_read32(movie);
+    if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
+        /* A frame is no use once the next one is due */
+        max_timestamp = min_timestamp + movie->video.ms_per_frame;
+    } else {
+        max_timestamp = min_timestamp + AUDIO_SLACK;
+    }
     if ( movie->use_timing ) {
         //timenow = SDL_GetTicks() - movie->start;
 
 #ifdef DEBUG_TIMING
 //printf("Time now: %d, timestamp: %d\n", timenow, min_timestamp);
 #endif
+        if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
+            /* Skip a frame that wouldn't be shown in time, going by how
+               long frames have been taking.  When decoding can't keep
+               up, this drops every so many frames instead of falling
+               behind and then dropping a run of them.
+             */
+            cost = (movie->video.cost + 15) >> 4;
+            ready = SDL_GetTicks() - movie->start + cost;
+            if ( ready > max_timestamp ) {
+#ifdef DEBUG_TIMING
+printf("Dropping frame %d\n", movie->video.frame);
+#endif
+                SkipBlock(movie, magic);
+                return(BLOCK_SKIPPED);
+            }
+        } else
         if ( timenow > max_timestamp ) {
             SkipBlock(movie, magic);
             return(BLOCK_SKIPPED);
@@ -620,14 +1605,16 @@ static int ParseBlock(SMJPEG *movie, int do_wait, Uint32 timestamp)
 
     /* Time to handle data -- handle known data packets */
     if ( MAGIC_EQUALS(magic, AUDIO_DATA_MAGIC) ) {
-        return(ParseAudio(movie));
+        return(ParseAudio(movie, do_wait));
     }
     if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
-        /* The video is the bounding stream */
+        /* The video is the bounding stream, and a frame is started
+           early enough to be shown when it is due */
         if ( movie->use_timing ) {
-            if ( timenow < min_timestamp ) {
+            if ( ready < min_timestamp ) {
                 if ( do_wait ) {
-                    int timediff = min_timestamp - (SDL_GetTicks() - movie->start);
+                    int timediff = min_timestamp - cost -
+                                   (SDL_GetTicks() - movie->start);
                     if ( timediff > TIMESLICE && timediff < 0xFFFFFF ) {
                         timediff -= TIMESLICE;
 #ifdef DEBUG_TIMING
@@ -637,7 +1624,8 @@ printf("Sleeping for %d milliseconds\n", timediff);
                     }
                 } else {
                     /* Seek to beginning of chunk */
-                    fseek(movie->src, -8, SEEK_CUR);
+                    src_seek(movie, -8, SEEK_CUR);
+                    --movie->video.frame;
                     return(EARLY_RETURN);
                 }
             }
@@ -650,6 +1638,505 @@ printf("Sleeping for %d milliseconds\n", timediff);
     return(BLOCK_SKIPPED);
 }
 
+/* Frame buffer states */
+#define SLOT_PENDING    0       /* Waiting for a decoding thread */
+#define SLOT_DECODING   1       /* Being decoded */
+#define SLOT_READY      2       /* Ready to be displayed */
+
+/* A frame decoding thread with its own JPEG decompressor */
+struct smjpeg_decoder {
+    SMJPEG *movie;
+    SDL_Thread *thread;
+    struct jpeg_error_mgr errmgr;
+    struct smjpeg_source_mgr srcmgr;
+    struct jpeg_decompress_struct cinfo;
+};
+
+/* Private function to free the background decoding frame buffers */
+static void SMJPEG_freequeue(SMJPEG *movie)
+{
+    int i;
+
+    if ( movie->queue.slot ) {
+        for ( i = 0; i < movie->queue.frames; ++i ) {
+            free(movie->queue.slot[i].pixels);
+            free(movie->queue.slot[i].rows);
+            free(movie->queue.slot[i].buffer);
+        }
+        free(movie->queue.slot);
+        movie->queue.slot = NULL;
+    }
+}
+
+/* Private function to read a compressed frame for the decoding threads
+   - frames in memory are decoded in place
+ */
+static int SMJPEG_readframe(SMJPEG *movie, struct smjpeg_frame *slot,
+                            Uint32 length)
+{
+    Uint8 *buffer;
+
+    if ( movie->mem.base ) {
+        if ( length > (movie->mem.size - movie->mem.pos) ) {
+            length = movie->mem.size - movie->mem.pos;
+        }
+        slot->jpeg = movie->mem.base + movie->mem.pos;
+        slot->length = length;
+        movie->mem.pos += length;
+        return(1);
+    }
+    if ( length > slot->maxlen ) {
+        buffer = (Uint8 *)realloc(slot->buffer, length);
+        if ( buffer == NULL ) {
+            return(0);
+        }
+        slot->buffer = buffer;
+        slot->maxlen = length;
+    }
+    slot->jpeg = slot->buffer;
+    slot->length = length;
+    return(src_read(movie, slot->buffer, length));
+}
+
+/* A frame decoding thread
+   - it decodes queued frames in any order, the display side shows
+     them in stream order.
+ */
+static int SMJPEG_decodeframes(void *data)
+{
+    struct smjpeg_decoder *decoder = (struct smjpeg_decoder *)data;
+    SMJPEG *movie = decoder->movie;
+    struct smjpeg_frame *slot;
+    int i, n;
+
+    SDL_mutexP(movie->queue.lock);
+    while ( ! movie->queue.quit ) {
+        /* Find the oldest frame nobody is working on */
+        slot = NULL;
+        n = movie->queue.head;
+        for ( i = 0; i < movie->queue.used; ++i ) {
+            if ( movie->queue.slot[n].state == SLOT_PENDING ) {
+                slot = &movie->queue.slot[n];
+                break;
+            }
+            n = (n+1)%movie->queue.frames;
+        }
+        if ( slot == NULL ) {
+            if ( movie->queue.done ) {
+                break;
+            }
+            SDL_CondWait(movie->queue.cond, movie->queue.lock);
+            continue;
+        }
+        slot->state = SLOT_DECODING;
+        SDL_mutexV(movie->queue.lock);
+
+        /* Decode the frame without holding any locks */
+        decoder->srcmgr.length = 0;
+        decoder->srcmgr.pub.next_input_byte = slot->jpeg;
+        decoder->srcmgr.pub.bytes_in_buffer = slot->length;
+        SMJPEG_decompress(movie, &decoder->cinfo, slot->rows, 0);
+
+        SDL_mutexP(movie->queue.lock);
+        slot->state = SLOT_READY;
+        SDL_CondBroadcast(movie->queue.cond);
+    }
+    SDL_mutexV(movie->queue.lock);
+    return(0);
+}
+
+/* The background decoding thread
+   - it parses the stream and decodes video frames into free frame
+     buffers, feeding audio chunks to the audio ring as it goes.
+     With several decoding threads, it only reads the frames and
+     leaves the decoding to them.
+ */
+static int SMJPEG_decodeahead(void *data)
+{
+    SMJPEG *movie = (SMJPEG *)data;
+    struct smjpeg_frame *slot;
+    Uint8 magic[4];
+    Uint32 timestamp;
+    Uint32 length;
+    Uint32 frame;
+
+    frame = movie->video.frame;
+    while ( ! movie->queue.quit ) {
+        /* Read this chunk type */
+        if ( !src_read(movie, magic, 4) || MAGIC_EQUALS(magic,DATA_END_MAGIC) ) {
+            if ( !src_eof(movie) ) {
+                src_seek(movie, -4, SEEK_CUR);
+            }
+            break;
+        }
+        timestamp = src_read32(movie);
+
+        if ( MAGIC_EQUALS(magic, AUDIO_DATA_MAGIC) ) {
+            ParseAudio(movie, 1);
+        } else
+        if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
+            /* Wait for a free frame buffer */
+            SDL_mutexP(movie->queue.lock);
+            while ( (movie->queue.used == movie->queue.frames) &&
+                    ! movie->queue.quit ) {
+                SDL_CondWait(movie->queue.cond, movie->queue.lock);
+            }
+            SDL_mutexV(movie->queue.lock);
+            if ( movie->queue.quit ) {
+                /* Seek to beginning of chunk */
+                src_seek(movie, -8, SEEK_CUR);
+                break;
+            }
+
+            /* Read or decode the frame without holding any locks */
+            slot = &movie->queue.slot[movie->queue.tail];
+            length = src_read32(movie);
+            if ( movie->queue.decoder ) {
+                if ( ! SMJPEG_readframe(movie, slot, length) ) {
+                    break;
+                }
+                slot->state = SLOT_PENDING;
+            } else {
+                SMJPEG_decodeJFIF(movie, length, slot->rows, 0);
+                slot->state = SLOT_READY;
+            }
+            slot->timestamp = timestamp;
+            slot->frame = ++frame;
+
+            /* Hand it to the decoding threads or the display side */
+            SDL_mutexP(movie->queue.lock);
+            slot->offset = movie->queue.offset;
+            movie->queue.offset = src_tell(movie);
+            movie->queue.tail = (movie->queue.tail+1)%movie->queue.frames;
+            ++movie->queue.used;
+            SDL_CondBroadcast(movie->queue.cond);
+            SDL_mutexV(movie->queue.lock);
+        } else {
+            SkipBlock(movie, magic);
+        }
+    }
+
+    SDL_mutexP(movie->queue.lock);
+    movie->queue.done = 1;
+    SDL_CondBroadcast(movie->queue.cond);
+    SDL_mutexV(movie->queue.lock);
+    return(0);
+}
+
+/* Private function to start the background decoding thread */
+static int SMJPEG_startqueue(SMJPEG *movie)
+{
+    struct smjpeg_decoder *decoder;
+    struct smjpeg_frame *slot;
+    int pitch;
+    int row;
+    int i;
+
+    if ( !movie->queue.frames || !movie->video.enabled ||
+         !movie->video.target ) {
+        return(0);
+    }
+
+    /* Allocate the frame buffers for the current target */
+    pitch = movie->video.out_width *
+            movie->video.target->format->BytesPerPixel;
+    if ( movie->video.doubled ) {
+        pitch *= 2;
+    }
+    if ( movie->queue.slot && (movie->queue.pitch != pitch) ) {
+        SMJPEG_freequeue(movie);
+    }
+    if ( ! movie->queue.slot ) {
+        movie->queue.slot = (struct smjpeg_frame *)
+                    calloc(movie->queue.frames, sizeof(*movie->queue.slot));
+        if ( movie->queue.slot == NULL ) {
+            SMJPEG_status(movie, -1, "Out of memory");
+            return(-1);
+        }
+        for ( i = 0; i < movie->queue.frames; ++i ) {
+            slot = &movie->queue.slot[i];
+            slot->pixels = (Uint8 *)malloc(pitch*movie->video.out_height);
+            slot->rows = (Uint8 **)
+                         malloc(movie->video.out_height*sizeof(Uint8 *));
+            if ( (slot->pixels == NULL) || (slot->rows == NULL) ) {
+                SMJPEG_freequeue(movie);
+                SMJPEG_status(movie, -1, "Out of memory");
+                return(-1);
+            }
+            for ( row = 0; row < movie->video.out_height; ++row ) {
+                slot->rows[row] = slot->pixels + row*pitch;
+            }
+        }
+        movie->queue.pitch = pitch;
+    }
+
+    /* Start decoding */
+    movie->queue.head = 0;
+    movie->queue.tail = 0;
+    movie->queue.used = 0;
+    movie->queue.quit = 0;
+    movie->queue.done = 0;
+    movie->queue.offset = src_tell(movie);
+    if ( movie->queue.threads > 1 ) {
+        movie->queue.decoder = (struct smjpeg_decoder *)
+                calloc(movie->queue.threads, sizeof(*movie->queue.decoder));
+        if ( movie->queue.decoder == NULL ) {
+            SMJPEG_status(movie, -1, "Out of memory");
+            return(-1);
+        }
+        for ( i = 0; i < movie->queue.threads; ++i ) {
+            decoder = &movie->queue.decoder[i];
+            decoder->movie = movie;
+            decoder->cinfo.err = jpeg_std_error(&decoder->errmgr);
+            jpeg_create_decompress(&decoder->cinfo);
+            jpeg_smjpeg_src(&decoder->cinfo, movie, &decoder->srcmgr);
+            decoder->cinfo.dct_method = JDCT_FASTEST;
+            decoder->cinfo.do_fancy_upsampling = FALSE;
+        }
+    }
+    movie->queue.thread = SDL_CreateThread(SMJPEG_decodeahead, movie);
+    if ( movie->queue.thread == NULL ) {
+        SMJPEG_status(movie, -1, "Couldn't create decoding thread");
+        SMJPEG_stopqueue(movie);
+        return(-1);
+    }
+    for ( i = 0; movie->queue.decoder && (i < movie->queue.threads); ++i ) {
+        decoder = &movie->queue.decoder[i];
+        decoder->thread = SDL_CreateThread(SMJPEG_decodeframes, decoder);
+        if ( decoder->thread == NULL ) {
+            SMJPEG_status(movie, -1, "Couldn't create decoding thread");
+            SMJPEG_stopqueue(movie);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/* Private function to stop the background decoding thread
+   - the stream is left at the first frame that wasn't displayed.
+ */
+static void SMJPEG_stopqueue(SMJPEG *movie)
+{
+    struct smjpeg_decoder *decoder;
+    int i;
+
+    if ( ! movie->queue.thread && ! movie->queue.decoder ) {
+        return;
+    }
+    SDL_mutexP(movie->queue.lock);
+    movie->queue.quit = 1;
+    SDL_CondBroadcast(movie->queue.cond);
+    SDL_mutexV(movie->queue.lock);
+    SMJPEG_ringsignal(movie);
+    if ( movie->queue.thread ) {
+        SDL_WaitThread(movie->queue.thread, NULL);
+        movie->queue.thread = NULL;
+    }
+    if ( movie->queue.decoder ) {
+        for ( i = 0; i < movie->queue.threads; ++i ) {
+            decoder = &movie->queue.decoder[i];
+            if ( decoder->thread ) {
+                SDL_WaitThread(decoder->thread, NULL);
+            }
+            jpeg_destroy_decompress(&decoder->cinfo);
+        }
+        free(movie->queue.decoder);
+        movie->queue.decoder = NULL;
+    }
+    movie->queue.quit = 0;
+
+    if ( movie->queue.used > 0 ) {
+        src_seek(movie,
+                 movie->queue.slot[movie->queue.head].offset, SEEK_SET);
+        movie->queue.used = 0;
+    }
+}
+
+/* Private function to copy a decoded frame to the display target */
+static void SMJPEG_presentframe(SMJPEG *movie, struct smjpeg_frame *slot)
+{
+    int row;
+
+    /* Lock the display target, if necessary */
+    if ( movie->video.target_lock ) {
+        SDL_mutexP(movie->video.target_lock);
+    }
+
+    for ( row=0; row < movie->video.out_height; ++row ) {
+        memcpy(movie->video.target_rows[row], slot->rows[row],
+                                              movie->queue.pitch);
+        if ( movie->video.doubled ) {
+            memcpy(movie->video.target_rows[row]+movie->video.target->pitch,
+                                    slot->rows[row], movie->queue.pitch);
+        }
+    }
+
+    /* Update the screen */
+    SMJPEG_update(movie);
+
+    /* Unlock the display target, if necessary */
+    if ( movie->video.target_lock ) {
+        SDL_mutexV(movie->video.target_lock);
+    }
+}
+
+/* Private function to advance using frames from the decoding thread */
+static int SMJPEG_advancequeue(SMJPEG *movie, int num_frames, int do_wait)
+{
+    const int TIMESLICE = 10;       /* OS timeslice, in milliseconds */
+    struct smjpeg_frame *slot;
+    struct smjpeg_frame *next;
+    Uint32 timenow;
+    int timediff;
+    int status;
+
+    status = EARLY_RETURN;
+    while ( num_frames && !movie->at_end ) {
+        /* Wait for a decoded frame, unless we'd rather return */
+        SDL_mutexP(movie->queue.lock);
+        slot = &movie->queue.slot[movie->queue.head];
+        while ( (movie->queue.used ? (slot->state != SLOT_READY)
+                                   : !movie->queue.done) &&
+                (do_wait || !movie->use_timing) ) {
+            SDL_CondWait(movie->queue.cond, movie->queue.lock);
+        }
+        if ( !movie->queue.used || (slot->state != SLOT_READY) ) {
+            if ( !movie->queue.used && movie->queue.done ) {
+                movie->at_end = 1;
+            }
+            SDL_mutexV(movie->queue.lock);
+            status = EARLY_RETURN;
+            break;
+        }
+
+        /* Pick the frame that is due, dropping any that are too late */
+        if ( movie->use_timing ) {
+            timenow = SDL_GetTicks() - movie->start;
+            if ( movie->queue.used > 1 ) {
+                next = &movie->queue.slot[(movie->queue.head+1) %
+                                          movie->queue.frames];
+                if ( (next->state == SLOT_READY) &&
+                     (next->timestamp <= timenow) ) {
+#ifdef DEBUG_TIMING
+printf("Dropping frame %d\n", slot->frame);
+#endif
+                    movie->video.frame = slot->frame;
+                    movie->queue.head = (movie->queue.head+1) %
+                                        movie->queue.frames;
+                    --movie->queue.used;
+                    SDL_CondBroadcast(movie->queue.cond);
+                    SDL_mutexV(movie->queue.lock);
+                    status = BLOCK_SKIPPED;
+                    continue;
+                }
+            }
+            SDL_mutexV(movie->queue.lock);
+            if ( timenow < slot->timestamp ) {
+                if ( ! do_wait ) {
+                    status = EARLY_RETURN;
+                    break;
+                }
+                timediff = slot->timestamp - timenow;
+                if ( timediff > TIMESLICE ) {
+                    SDL_Delay(timediff - TIMESLICE);
+                }
+            }
+        } else {
+            SDL_mutexV(movie->queue.lock);
+        }
+
+        /* Display it and give the buffer back to the decoding thread */
+        SMJPEG_presentframe(movie, slot);
+        movie->video.frame = slot->frame;
+        movie->current = slot->timestamp;
+        SDL_mutexP(movie->queue.lock);
+        movie->queue.head = (movie->queue.head+1)%movie->queue.frames;
+        --movie->queue.used;
+        SDL_CondBroadcast(movie->queue.cond);
+        SDL_mutexV(movie->queue.lock);
+
+        status = BLOCK_PLAYED;
+        --num_frames;
+    }
+    return(status == BLOCK_PLAYED);
+}
+
+/* Decode frames ahead of playback on a background thread */
+int SMJPEG_queue(SMJPEG *movie, int frames)
+{
+    SMJPEG_stopqueue(movie);
+    SMJPEG_freequeue(movie);
+    if ( frames < 0 ) {
+        frames = 0;
+    }
+    if ( frames && (frames < movie->queue.threads) ) {
+        frames = movie->queue.threads;
+    }
+    movie->queue.frames = frames;
+    if ( frames && ! movie->queue.lock ) {
+        movie->queue.lock = SDL_CreateMutex();
+        movie->queue.cond = SDL_CreateCond();
+        if ( !movie->queue.lock || !movie->queue.cond ) {
+            SMJPEG_status(movie, -1, "Couldn't create decoding thread lock");
+            movie->queue.frames = 0;
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/* Set the size of the decoded audio ring */
+int SMJPEG_audiobuffer(SMJPEG *movie, int bytes)
+{
+    struct dataring *ring = &movie->audio.ring;
+    Uint32 size;
+    Uint8 *buf;
+
+    /* A power of two, and room for at least a few pieces of ADPCM */
+    size = 8*ADPCM_PIECE;
+    while ( ((int)size < bytes) && (size < 0x40000000) ) {
+        size *= 2;
+    }
+    SMJPEG_stopqueue(movie);
+    if ( ! ring->wake ) {
+        ring->wake = SDL_CreateSemaphore(0);
+        if ( ! ring->wake ) {
+            SMJPEG_status(movie, -1, "Couldn't create audio buffer semaphore");
+            return(-1);
+        }
+    }
+    buf = (Uint8 *)malloc(size);
+    if ( buf == NULL ) {
+        SMJPEG_status(movie, -1, "Out of memory");
+        return(-1);
+    }
+    if ( ring->buf ) {
+        free(ring->buf);
+    }
+    ring->buf = buf;
+    ring->size = size;
+    ring->read = 0;
+    ring->write = 0;
+    ring->flush = 0;
+    movie->audio.queued = 0;
+    return(0);
+}
+
+/* Decode frames on several threads at once */
+int SMJPEG_threads(SMJPEG *movie, int threads)
+{
+    if ( threads < 1 ) {
+        threads = 1;
+    }
+    movie->queue.threads = threads;
+
+    /* Keep every thread busy and one more frame on the way */
+    if ( (threads > 1) && (movie->queue.frames <= threads) ) {
+        return(SMJPEG_queue(movie, threads+1));
+    }
+    return(SMJPEG_queue(movie, movie->queue.frames));
+}
+
 /* Advance the specified number of frames, or the whole movie if -1 */
 /* FIXME:  Clean up this mess a little bit */
 int SMJPEG_advance(SMJPEG *movie, int num_frames, int do_wait)
@@ -657,6 +2144,11 @@ int SMJPEG_advance(SMJPEG *movie, int num_frames, int do_wait)
     int status;
     Uint32 timestamp = SDL_GetTicks();
 
+    /* Frames may already be decoded by the background thread */
+    if ( movie->queue.thread ) {
+        return(SMJPEG_advancequeue(movie, num_frames, do_wait));
+    }
+
     while ( num_frames && !movie->at_end ) {
         status = ParseBlock(movie, do_wait, timestamp);
         switch (status) {
@@ -664,8 +2156,8 @@ int SMJPEG_advance(SMJPEG *movie, int num_frames, int do_wait)
                 --num_frames;
                 break;
             case BLOCK_SKIPPED:
-            case BLOCK_NOT_READY:
                 break;
+            case BLOCK_NOT_READY:
             case EARLY_RETURN:
                 num_frames = 0;
                 break;
@@ -674,12 +2166,212 @@ int SMJPEG_advance(SMJPEG *movie, int num_frames, int do_wait)
     return(status == BLOCK_PLAYED);
 }
 
+/* Private function to get the bytes a pixel of the movie takes in the
+   given output format, or 0 if the format isn't supported
+   - the doubled formats also take two rows of output for each row.
+*/
+static int SMJPEG_pixelsize(J_COLOR_SPACE format, int *doubled)
+{
+    *doubled = 0;
+    switch (format) {
+        case JCS_GRAYSCALE:
+            return(1);
+        case JCS_RGB:
+        case JCS_YCbCr:
+            return(3);
+        case JCS_RGB16_555:
+        case JCS_BGR16_555:
+        case JCS_RGB16_565:
+            return(2);
+        case JCS_RGB16_555_DBL:
+        case JCS_BGR16_555_DBL:
+        case JCS_RGB16_565_DBL:
+            *doubled = 1;
+            return(4);
+        case JCS_XRGB32:
+        case JCS_XBGR32:
+            return(4);
+        case JCS_XRGB32_DBL:
+        case JCS_XBGR32_DBL:
+            *doubled = 1;
+            return(8);
+        default:
+            return(0);
+    }
+}
+
+/* Private function to find the next video chunk, skipping any audio
+   - returns 1 with the data source at the start of the jpeg data,
+     or 0 at the end of the stream.
+*/
+static int SMJPEG_nextframe(SMJPEG *movie, Uint32 *length)
+{
+    Uint8 magic[4];
+    Uint32 timestamp;
+
+    for ( ; ; ) {
+        if ( !src_read(movie, magic, 4) ||
+             MAGIC_EQUALS(magic, DATA_END_MAGIC) ) {
+            movie->at_end = 1;
+            if ( !src_eof(movie) ) {
+                src_seek(movie, -4, SEEK_CUR);
+            }
+            return(0);
+        }
+        timestamp = src_read32(movie);
+        if ( MAGIC_EQUALS(magic, VIDEO_DATA_MAGIC) ) {
+            break;
+        }
+        SkipBlock(movie, magic);
+    }
+    ++movie->video.frame;
+    movie->current = timestamp;
+    *length = src_read32(movie);
+    return(1);
+}
+
+/* Decode the next video frame into a buffer, skipping any audio on the way
+   - returns 1 if a frame was decoded, or 0 at the end of the stream.
+*/
+int SMJPEG_decode_frame_into(SMJPEG *movie, void *pixels, int pitch,
+                             J_COLOR_SPACE format)
+{
+    Uint8 **rows;
+    Uint32 length;
+    J_COLOR_SPACE colorspace;
+    int doubled;
+    int size;
+    int row;
+
+    if ( !movie->video.enabled ) {
+        SMJPEG_status(movie, -1, "No video stream to decode");
+        return(-1);
+    }
+    if ( movie->queue.thread ) {
+        SMJPEG_status(movie, -1, "Can't decode frames during playback");
+        return(-1);
+    }
+    size = SMJPEG_pixelsize(format, &doubled);
+    if ( !size ) {
+        SMJPEG_status(movie, -1, "Unsupported output color format");
+        return(-1);
+    }
+    if ( pitch < (size * movie->video.out_width) ) {
+        SMJPEG_status(movie, -1, "Output pitch too small for the frame");
+        return(-1);
+    }
+
+    /* Find the next video chunk */
+    if ( !SMJPEG_nextframe(movie, &length) ) {
+        return(0);
+    }
+
+    /* Decompress to the buffer */
+    rows = (Uint8 **)malloc(movie->video.out_height*sizeof(Uint8 *));
+    if ( rows == NULL ) {
+        src_seek(movie, length, SEEK_CUR);
+        SMJPEG_status(movie, -1, "Out of memory");
+        return(-1);
+    }
+    for ( row=0; row < movie->video.out_height; ++row ) {
+        rows[row] = (Uint8 *)pixels + (doubled ? 2*row : row)*pitch;
+    }
+    colorspace = movie->jpeg_colorspace;
+    movie->jpeg_colorspace = format;
+    SMJPEG_decodeJFIF(movie, length, rows, doubled ? pitch : 0);
+    movie->jpeg_colorspace = colorspace;
+    free(rows);
+    return(1);
+}
+
+/* Decode the next video frame as planar YUV, skipping any audio on the way
+   - returns 1 if a frame was decoded, or 0 at the end of the stream.
+*/
+int SMJPEG_decode_frame_yuv(SMJPEG *movie, Uint8 *planes[3], int pitches[3])
+{
+    Uint32 length;
+    int status;
+
+    if ( !movie->video.enabled ) {
+        SMJPEG_status(movie, -1, "No video stream to decode");
+        return(-1);
+    }
+    if ( movie->queue.thread ) {
+        SMJPEG_status(movie, -1, "Can't decode frames during playback");
+        return(-1);
+    }
+    if ( (pitches[0] < movie->video.out_width) ||
+         (pitches[1] < (movie->video.out_width+1)/2) ||
+         (pitches[2] < (movie->video.out_width+1)/2) ) {
+        SMJPEG_status(movie, -1, "Output pitch too small for the frame");
+        return(-1);
+    }
+
+    /* Find the next video chunk */
+    if ( !SMJPEG_nextframe(movie, &length) ) {
+        return(0);
+    }
+
+    /* Decompress to the planes */
+    SMJPEG_sourceJFIF(movie, length);
+    status = SMJPEG_decompress_yuv(movie, &movie->jpeg_cinfo, planes, pitches);
+    SMJPEG_skipJFIF(movie);
+    if ( status < 0 ) {
+        return(-1);
+    }
+    return(1);
+}
+
+/* Decode the next video frame into a YV12 or IYUV overlay */
+int SMJPEG_decode_frame_overlay(SMJPEG *movie, SDL_Overlay *overlay)
+{
+    Uint8 *planes[3];
+    int pitches[3];
+    int i, status;
+
+    if ( (overlay->w < movie->video.out_width) ||
+         (overlay->h < movie->video.out_height) ) {
+        SMJPEG_status(movie, -1, "Overlay is smaller than the frame");
+        return(-1);
+    }
+    if ( (overlay->format != SDL_IYUV_OVERLAY) &&
+         (overlay->format != SDL_YV12_OVERLAY) ) {
+        SMJPEG_status(movie, -1, "Unsupported overlay format");
+        return(-1);
+    }
+    if ( SDL_LockYUVOverlay(overlay) < 0 ) {
+        SMJPEG_status(movie, -1, "Couldn't lock the overlay");
+        return(-1);
+    }
+    for ( i=0; i<3; ++i ) {
+        planes[i] = overlay->pixels[i];
+        pitches[i] = overlay->pitches[i];
+    }
+    /* YV12 has the V (Cr) plane before the U (Cb) plane */
+    if ( overlay->format == SDL_YV12_OVERLAY ) {
+        planes[1] = overlay->pixels[2];
+        pitches[1] = overlay->pitches[2];
+        planes[2] = overlay->pixels[1];
+        pitches[2] = overlay->pitches[1];
+    }
+    status = SMJPEG_decode_frame_yuv(movie, planes, pitches);
+    SDL_UnlockYUVOverlay(overlay);
+    return(status);
+}
+
 /* Stop playback of a movie */
 void SMJPEG_stop(SMJPEG *movie)
 {
+    /* Stop decoding ahead */
+    SMJPEG_stopqueue(movie);
+
     /* Wait for the audio to get flushed */
-    while ( (movie->audio.ring.used > 0) && movie->audio.enabled ) {
-        SDL_Delay(10);
+    if ( movie->audio.ring.wake ) {
+        SMJPEG_ringsleep(movie, 1);
+        while ( (SMJPEG_audioqueued(movie) > 0) && movie->audio.enabled ) {
+            SDL_SemWait(movie->audio.ring.wake);
+        }
+        SMJPEG_ringsleep(movie, 0);
     }
     movie->at_end = 1;
 }
@@ -688,45 +2380,53 @@ void SMJPEG_feedaudio(void *udata, Uint8 *stream, int len)
 {
     SMJPEG *movie = (SMJPEG *)udata;
     struct dataring *ring;
-    Uint8 buf[SMJPEG_AUDIO_MAX_CHUNK];
+    Uint32 read, flush;
+    Uint32 avail, pos, piece;
 
     ring = &movie->audio.ring;
 
-    if ( !movie->audio.enabled )
+    if ( !movie->audio.enabled ) {
+        /* The parsing side may be waiting to see this */
+        SMJPEG_ringsignal(movie);
         return;
+    }
 
+    /* We are the only writer of the read counter */
+    read = ring->read;
     while ( len > 0 )
     {
-        if ( ring-> used <= 0 )
-            if ( END_OF_STREAM(movie, "") )
-               return;
-            else
-                SDL_Delay(1);
+        /* Skip any audio thrown away by a seek */
+        flush = RING_LOAD(ring->flush);
+        if ( (Sint32)(flush - read) > 0 ) {
+            read = flush;
+            RING_STORE(ring->read, read);
+            SMJPEG_ringsignal(movie);
+        }
+
+        avail = RING_LOAD(ring->write) - read;
+        if ( avail == 0 ) {
+            /* Play silence rather than wait for the parsing side */
+            memset(stream, (movie->audio.bits == 8) ? 0x80 : 0, len);
+            return;
+        }
         else
         {
-            SDL_mutexP(movie->audio.ring.audio_mutex);
-
-            if ( ring->ringbuf[ring->read].len <= len ) 
-            {
-                memcpy(stream, ring->ringbuf[ring->read].buf,
-                                ring->ringbuf[ring->read].len);
-                len -= ring->ringbuf[ring->read].len;
-                stream = &stream[ring->ringbuf[ring->read].len];
-                ring->read = (ring->read+1)%SMJPEG_AUDIO_BUFFERS;
-                --ring->used;
-            } 
-            else 
-            {
-                memcpy(stream, ring->ringbuf[ring->read].buf, len);
-                /* WARNING: requires an overlapping memcpy */
-                ring->ringbuf[ring->read].len -= len;
-                stream = &stream[ring->ringbuf[ring->read].len];
-                memcpy(ring->ringbuf[ring->read].buf,
-                            &ring->ringbuf[ring->read].buf[len],
-                            ring->ringbuf[ring->read].len);
-                len = 0;
-            }
-            SDL_mutexV(movie->audio.ring.audio_mutex);
+            /* The bytes up to the write counter belong to us */
+            if ( avail > (Uint32)len ) {
+                avail = len;
+            }
+            pos = read & (ring->size-1);
+            piece = ring->size - pos;
+            if ( piece > avail ) {
+                piece = avail;
+            }
+            memcpy(stream, &ring->buf[pos], piece);
+            memcpy(&stream[piece], ring->buf, avail - piece);
+            stream += avail;
+            len -= avail;
+            read += avail;
+            RING_STORE(ring->read, read);
+            SMJPEG_ringsignal(movie);
         }
 
     }
@@ -7,14 +7,31 @@
 #include <jpeglib.h>
 #include "SDL.h"
 #include "SDL_byteorder.h"
+#include "SDL_thread.h"
 
-#define SMJPEG_AUDIO_BUFFERS    32
-#define SMJPEG_AUDIO_MAX_CHUNK  4096
+#define SMJPEG_AUDIO_BUFFER     (128*1024)  /* Default audio ring size */
 
 typedef struct SMJPEG {
     /* The data source */
     FILE *src;
 
+    /* Memory data source, used in place of src when base is set */
+    struct {
+        const Uint8 *base;
+        Uint32 size;
+        Uint32 pos;
+        int eof;
+        int mapped;     /* Non-zero if base was mapped from a file */
+        int allocated;  /* Non-zero if base was allocated by the library */
+    } mem;
+
+    /* Application data source, used in place of src when ops is set */
+    struct {
+        SDL_RWops *ops;
+        int eof;
+        int freesrc;    /* Non-zero if ops is closed by SMJPEG_free() */
+    } rw;
+
     int at_end;     /* Non-zero if at the end of the stream */
 
     Uint32 start;   /* Playback start time */
@@ -23,6 +40,21 @@ typedef struct SMJPEG {
 
     int use_timing; /* Non-zero if time synchronization is done */
 
+    /* Chunk index used for seeking (loaded from the file if it has one,
+       otherwise built on the first seek) */
+    struct {
+        Uint32 data_start;  /* Offset of the first data chunk */
+        Uint32 data_end;    /* Offset of the chunks after the last group */
+        int entries;
+        struct smjpeg_index_entry {
+            Uint32 timestamp;   /* Timestamp of the group's video chunk */
+            Uint32 offset;      /* Offset of the first chunk in the group */
+            Uint32 frame;       /* Number of video frames before the group */
+            Uint32 chunk;       /* Offset of the group's video chunk */
+            Uint32 length;      /* Length of the video chunk data */
+        } *entry;
+    } index;
+
     /* Status information block (code < 0 when an error occurs) */
     struct {
         int code;
@@ -35,20 +67,27 @@ typedef struct SMJPEG {
         int rate;
         int bits;
         int channels;
+        Uint32 queued;  /* Offset past the last chunk in the ring, or 0 */
 
-        /* Output buffer information */
+        /* Output buffer information
+           The ring has one producer (the parsing thread) and one consumer
+           (SMJPEG_feedaudio on the audio thread) and takes no lock: the
+           byte counters only ever increase, and each is written by one
+           side.  The size is a power of two, so a counter masked with
+           size-1 is its position in the buffer.  The audio thread never
+           waits, and plays silence if the ring runs dry.  The parsing
+           side sleeps on the semaphore when the ring is full, with the
+           waiting flag set so the audio thread knows to post to it.
+         */
         Uint8 encoding[4];
         struct dataring {
-            int read;
-            int write;
-            int used;
-            // Added by Joe
-//            SDL_mutux audio_buffer_mutex;
-            struct {
-                int len;
-                Uint8 buf[SMJPEG_AUDIO_MAX_CHUNK];
-            } ringbuf[SMJPEG_AUDIO_BUFFERS]; 
-            SDL_mutex *audio_mutex;
+            Uint8 *buf;
+            Uint32 size;
+            Uint32 read;    /* Bytes taken, written by the consumer */
+            Uint32 write;   /* Bytes queued, written by the producer */
+            Uint32 flush;   /* Bytes before this are thrown away */
+            Uint32 waiting; /* Non-zero while a side sleeps on wake */
+            SDL_sem *wake;
         } ring;
     } audio;
 
@@ -59,7 +98,11 @@ typedef struct SMJPEG {
         int ms_per_frame;
         int width;
         int height;
+        int scale;      /* Frames are decoded at 1/scale of their size */
+        int out_width;  /* Size of the decoded frames */
+        int out_height;
         Uint32 frame;   /* Current frame */
+        Uint32 cost;    /* Average time to show a frame, in 1/16 ms */
 
         /* Output target information */
         Uint8 encoding[4];
@@ -72,6 +115,35 @@ typedef struct SMJPEG {
         void (*target_update)(SDL_Surface *target, int x, int y, unsigned int w, unsigned int h);
     } video;
 
+    /* Background decoding information */
+    struct {
+        int frames;     /* Number of frames decoded ahead, 0 if disabled */
+        int threads;    /* Number of frame decoding threads */
+        SDL_Thread *thread;
+        SDL_mutex *lock;
+        SDL_cond *cond;
+        int quit;       /* Non-zero when the decoding thread should stop */
+        int done;       /* Non-zero when the decoding thread hit the end */
+        int pitch;      /* Bytes per row in the frame buffers */
+        int head;       /* Next frame buffer to be displayed */
+        int tail;       /* Next frame buffer to be decoded into */
+        int used;       /* Number of decoded frame buffers waiting */
+        Uint32 offset;  /* Offset of the next chunk group to be decoded */
+        struct smjpeg_frame {
+            Uint8 *pixels;
+            Uint8 **rows;
+            Uint32 timestamp;
+            Uint32 frame;
+            Uint32 offset;  /* Offset of the frame's chunk group */
+            int state;
+            const Uint8 *jpeg;  /* Compressed frame for a decoding thread */
+            Uint32 length;
+            Uint8 *buffer;
+            Uint32 maxlen;
+        } *slot;
+        struct smjpeg_decoder *decoder;
+    } queue;
+
     /* JFIF decode information */
     int jpeg_colorspace;
     struct jpeg_error_mgr jpeg_errmgr;
@@ -79,9 +151,10 @@ typedef struct SMJPEG {
         struct jpeg_source_mgr pub;
 
         struct SMJPEG *movie;
-        FILE *stream;
         Uint32 length;
         Uint8 buffer[4096];
+        Uint8 *frame;   /* Whole frame read from a file or RWops */
+        Uint32 maxlen;
     } jpeg_srcmgr;
     struct jpeg_decompress_struct jpeg_cinfo;
 
@@ -99,6 +172,19 @@ extern "C" {
 
 extern DECLSPEC int SMJPEG_load(SMJPEG *movie, const char *file);
 
+/* Load an SMJPEG file by mapping it into memory instead of using stdio */
+extern DECLSPEC int SMJPEG_load_mmap(SMJPEG *movie, const char *file);
+
+/* Load an SMJPEG animation from memory, which is decoded in place and
+   must remain valid until SMJPEG_free() is called.
+ */
+extern DECLSPEC int SMJPEG_load_mem(SMJPEG *movie, const void *data, size_t size);
+
+/* Load an SMJPEG animation using the read, seek and close callbacks of
+   an SDL_RWops data source, closing it in SMJPEG_free() if freesrc is set.
+ */
+extern DECLSPEC int SMJPEG_load_rw(SMJPEG *movie, SDL_RWops *src, int freesrc);
+
 extern DECLSPEC void SMJPEG_free(SMJPEG *movie);
 
 /* Turn on or off pixel doubling for SMJPEG display.
@@ -106,6 +192,35 @@ extern DECLSPEC void SMJPEG_free(SMJPEG *movie);
  */
 extern DECLSPEC void SMJPEG_double(SMJPEG *movie, int state);
 
+/* Decode the video at 1/2, 1/4 or 1/8 of its size (scale 2, 4 or 8),
+   or at full size if scale is 1 (the default).  The JPEG decoder does
+   less work at the smaller sizes, rather than scaling the frame down.
+   Drawing to a target and the hicolor, BGR and 32-bit formats upsample
+   the color of 4:2:0 frames from half the decoded size, so at the smaller
+   sizes color detail is reduced by a further 2x; the brightness is not.
+   You must call SMJPEG_target() after you call this function.
+ */
+extern DECLSPEC int SMJPEG_set_scale(SMJPEG *movie, int scale);
+
+/* Decode up to the given number of frames ahead of playback on a
+   background thread, or decode inline if frames is 0 (the default).
+   The frame buffers are sized for the target when SMJPEG_start() is
+   called, and SMJPEG_advance() then only copies the frame that is due.
+ */
+extern DECLSPEC int SMJPEG_queue(SMJPEG *movie, int frames);
+
+/* Decode frames on the given number of threads, each with its own JPEG
+   decompressor.  Frames are still displayed in order.  This turns on
+   decoding ahead with at least one more frame than there are threads.
+ */
+extern DECLSPEC int SMJPEG_threads(SMJPEG *movie, int threads);
+
+/* Set how many bytes of decoded audio may be buffered ahead of playback.
+   This is rounded up to a power of two, and throws away any audio already
+   buffered, so only call it while the movie and the audio are stopped.
+ */
+extern DECLSPEC int SMJPEG_audiobuffer(SMJPEG *movie, int bytes);
+
 /* Set the target display for video playback of an SMJPEG video */
 extern DECLSPEC int SMJPEG_target(SMJPEG *movie,
        SDL_mutex *lock, int x, int y, SDL_Surface *target,
@@ -114,6 +229,9 @@ extern DECLSPEC int SMJPEG_target(SMJPEG *movie,
 /* Seek to a particular offset in the MJPEG stream */
 extern DECLSPEC int SMJPEG_seek(SMJPEG *movie, Uint32 ms);
 
+/* Seek to the start of a particular video frame, counting from 0 */
+extern DECLSPEC int SMJPEG_seek_frame(SMJPEG *movie, Uint32 frame);
+
 /* Functions for saving the current position and restoring it */
 extern DECLSPEC Uint32 SMJPEG_getposition(SMJPEG *movie);
 extern DECLSPEC void SMJPEG_setposition(SMJPEG *movie, Uint32 pos);
@@ -130,6 +248,33 @@ extern DECLSPEC int SMJPEG_advance(SMJPEG *movie, int num_frames, int do_wait);
 /* Stop playback of a movie */
 extern DECLSPEC void SMJPEG_stop(SMJPEG *movie);
 
+/* Decode the next video frame straight into a buffer in the given color
+   format, without a target surface.  Any audio on the way is skipped.
+   The supported formats are JCS_GRAYSCALE, JCS_RGB, JCS_YCbCr, the
+   hicolor formats and the 32-bit JCS_XRGB32 and JCS_XBGR32 formats.
+   The _DBL formats double the frame in both directions.
+   This returns 1 if a frame was decoded, 0 at the end of the stream or
+   -1 on an error, and can't be used while frames are decoded ahead.
+ */
+extern DECLSPEC int SMJPEG_decode_frame_into(SMJPEG *movie,
+                                void *pixels, int pitch, J_COLOR_SPACE format);
+
+/* Decode the next video frame as planar YUV straight from the JPEG decoder,
+   without upsampling or color conversion.  The planes are given in the
+   order Y, U (Cb), V (Cr), and U and V are half the width and height of
+   the frame, as in I420; for YV12 pass the last two in reverse order.
+   Only frames with 4:2:0 sampling can be decoded this way.
+   This returns like SMJPEG_decode_frame_into().
+ */
+extern DECLSPEC int SMJPEG_decode_frame_yuv(SMJPEG *movie,
+                                Uint8 *planes[3], int pitches[3]);
+
+/* Decode the next video frame into an SDL_YV12_OVERLAY or SDL_IYUV_OVERLAY
+   overlay, which is locked while the frame is written.
+ */
+extern DECLSPEC int SMJPEG_decode_frame_overlay(SMJPEG *movie,
+                                SDL_Overlay *overlay);
+
 /* Function that can be passed to SDL as an audio callback */
 extern DECLSPEC void SMJPEG_feedaudio(void *udata, Uint8 *stream, int len);
 
@@ -3,15 +3,28 @@
    and constructs a motion jpeg animation from it.
 */
 
+#ifdef HAVE_COPY_FILE_RANGE
+#define _GNU_SOURCE     /* For copy_file_range() */
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#else
+#undef HAVE_SENDFILE
+#endif
 
 #include <jpeglib.h>
+#include "cdjpeg.h"     /* The image file readers used by cjpeg */
 
 #include "adpcm.h"
 #include "smjpeg_file.h"
@@ -26,15 +39,101 @@
 /* Default video encoding parameters */
 #define DEFAULT_VIDEO_ENCODING  VIDEO_ENCODING_JPEG
 #define DEFAULT_VIDEO_FPS       15.0
+#define DEFAULT_JPEG_QUALITY    75     /* Quality of compressed frames */
+
+#define JPEG_SOI        0xD8    /* SOI marker code, to go with JPEG_EOI */
+
+#define FRAMES_UNKNOWN  0xFFFFFFFF  /* Frame count of a stream on a pipe */
 
 #define DEFAULT_JPEG_PREFIX    "frame."
 #define DEFAULT_AUDIO_INPUT    "audio.raw"
 #define DEFAULT_OUTPUT_FILE    "output.mjpg"
 
+#define OUTPUT_BUFFER   (1024*1024)     /* Size of the output stdio buffer */
+
 typedef unsigned char  Uint8;
 typedef unsigned short Uint16;
 typedef unsigned int   Uint32;
 
+/* Index of chunk groups, written after the end of data marker */
+struct index_entry {
+    Uint32 timestamp;
+    Uint32 offset;
+    Uint32 chunk;
+    Uint32 length;
+};
+static struct index_entry *index_entries = NULL;
+static Uint32 index_used = 0;
+static Uint32 index_allocated = 0;
+
+/* Record a chunk group in the index */
+int AddIndexEntry(double timestamp, Uint32 offset, Uint32 chunk, Uint32 length)
+{
+    struct index_entry *entry;
+
+    if ( index_used == index_allocated ) {
+        index_allocated = index_allocated ? index_allocated*2 : 1024;
+        entry = (struct index_entry *)realloc(index_entries,
+                                      index_allocated*sizeof(*entry));
+        if ( entry == NULL ) {
+            fprintf(stderr, "Out of memory\n");
+            return(-1);
+        }
+        index_entries = entry;
+    }
+    entry = &index_entries[index_used++];
+    entry->timestamp = (Uint32)timestamp;
+    entry->offset = offset;
+    entry->chunk = chunk;
+    entry->length = length;
+    return(0);
+}
+
+/* Write the index block and point the index header at it */
+int WriteIndex(FILE *output, Uint32 header_offset, Uint32 data_end)
+{
+    Uint32 offset;
+    Uint32 length;
+    Uint32 i;
+
+    offset = ftell(output);
+    length = 12 + index_used*16;
+    fwrite(INDEX_DATA_MAGIC, 4, 1, output);
+    WRITE32(index_used, output);
+    WRITE32(data_end, output);
+    for ( i = 0; i < index_used; ++i ) {
+        WRITE32(index_entries[i].timestamp, output);
+        WRITE32(index_entries[i].offset, output);
+        WRITE32(index_entries[i].chunk, output);
+        WRITE32(index_entries[i].length, output);
+    }
+
+    /* Fill in the index header */
+    if ( fseek(output, header_offset+8, SEEK_SET) < 0 ) {
+        fprintf(stderr, "Unable to seek in output: %s\n", strerror(errno));
+        return(-1);
+    }
+    WRITE32(offset, output);
+    WRITE32(length, output);
+    fseek(output, 0, SEEK_END);
+    return(0);
+}
+
+/* Fill in the movie length and the number of frames in the video header */
+int WriteVideoLength(FILE *output, Uint32 header_offset, Uint32 frames,
+                     double fps)
+{
+    if ( fseek(output, 12, SEEK_SET) < 0 ) {
+        fprintf(stderr, "Unable to seek in output: %s\n", strerror(errno));
+        return(-1);
+    }
+    WRITE32((Uint32)(((double)frames/fps)*1000.0), output);
+    fseek(output, header_offset+8, SEEK_SET);
+    WRITE32(frames, output);
+    fseek(output, 0, SEEK_END);
+    return(0);
+}
+
 /* Open a JPEG file and get the image width and height */
 int get_jpeg_dimensions(const char *file, Uint16 *w, Uint16 *h)
 {
@@ -61,6 +160,90 @@ int get_jpeg_dimensions(const char *file, Uint16 *w, Uint16 *h)
     return(status);
 }
 
+/* Messages of the image file readers, as in cjpeg */
+#define JMESSAGE(code,string)	string ,
+
+static const char * const cdjpeg_message_table[] = {
+#include "cderror.h"
+  NULL
+};
+
+/* Check whether a file is a JPEG image, rather than one to be compressed */
+int is_jpeg_file(const char *file)
+{
+    FILE *input;
+    Uint8 magic[2];
+    int is_jpeg;
+
+    is_jpeg = 0;
+    input = fopen(file, "rb");
+    if ( input ) {
+        if ( (fread(magic, 2, 1, input) == 1) &&
+             (magic[0] == 0xFF) && (magic[1] == JPEG_SOI) ) {
+            is_jpeg = 1;
+        }
+        fclose(input);
+    }
+    return(is_jpeg);
+}
+
+/* Pick an image file reader from the first byte of the file, as cjpeg does */
+cjpeg_source_ptr select_image_reader(j_compress_ptr cinfo, FILE *input)
+{
+    int c;
+
+    if ( (c = getc(input)) == EOF ) {
+        ERREXIT(cinfo, JERR_INPUT_EMPTY);
+    }
+    if ( ungetc(c, input) == EOF ) {
+        ERREXIT(cinfo, JERR_UNGETC_FAILED);
+    }
+    switch (c) {
+        case 'B':
+            return(jinit_read_bmp(cinfo));
+        case 'P':
+            return(jinit_read_ppm(cinfo));
+        case 0x00:
+            return(jinit_read_targa(cinfo));
+        default:
+            ERREXIT(cinfo, JERR_UNKNOWN_FORMAT);
+            break;
+    }
+    return(NULL);
+}
+
+/* Open an image file to be compressed and get the image width and height */
+int get_image_dimensions(const char *file, Uint16 *w, Uint16 *h)
+{
+    FILE *input;
+    int status;
+
+    status = -1;
+    input = fopen(file, "rb");
+    if ( input ) {
+        struct jpeg_error_mgr errmgr;
+        struct jpeg_compress_struct cinfo;
+        cjpeg_source_ptr source;
+
+        cinfo.err = jpeg_std_error(&errmgr);
+        errmgr.addon_message_table = cdjpeg_message_table;
+        errmgr.first_addon_message = JMSG_FIRSTADDONCODE;
+        errmgr.last_addon_message = JMSG_LASTADDONCODE;
+        jpeg_create_compress(&cinfo);
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        source = select_image_reader(&cinfo, input);
+        source->input_file = input;
+        (*source->start_input)(&cinfo, source);
+        *w = cinfo.image_width;
+        *h = cinfo.image_height;
+        jpeg_destroy_compress(&cinfo);
+        fclose(input);
+        status = 0;
+    }
+    return(status);
+}
+
 int WriteAudioChunk(FILE *input, double timestamp, Uint32 size,
                              const char *encoding, FILE *output, Uint8 channels, void* data)
 {
@@ -100,7 +283,7 @@ int WriteAudioChunk(FILE *input, double timestamp, Uint32 size,
         if ( MAGIC_EQUALS(encoding, AUDIO_ENCODING_ADPCM) ) {
             Uint8 encoded[BUFSIZ];
 
-            SMJPEG_adpcm_coder((short *)buffer, encoded, len/2, channels, (struct adpcm_state*) data);
+            SMJPEG_adpcm_coder((short *)buffer, (char *)encoded, len/2, channels, (struct adpcm_state*) data);
             fwrite(encoded, len/4, 1, output);
         } else {
             fwrite(buffer, len, 1, output);
@@ -109,23 +292,962 @@ int WriteAudioChunk(FILE *input, double timestamp, Uint32 size,
     return(0);
 }
 
+#ifdef HAVE_PTHREAD_H
+/* Pipelined encoding
+   Frame files are read ahead by a set of reader threads, which also
+   compress them if they are raw images, each thread with its own JPEG
+   compressor.  The audio is read and encoded a batch of chunks at a time
+   on its own thread, while the main thread writes the chunks out in order.
+
+   Each audio chunk carries the predictor state it starts with, so chunks
+   can also be encoded independently.  In that case a chunk's state is
+   found by running the coder over the PCM just before it, and the chunks
+   of a batch are shared out among several threads.  With one thread the
+   state is carried from chunk to chunk as in WriteAudioChunk().
+ */
+#define AUDIO_WARMUP    64      /* Sample frames used to seed a chunk */
+#define AUDIO_BATCH     64      /* Chunks per thread in a batch */
+#define READER_THREADS  4       /* Threads reading frame files ahead */
+#define STREAM_BUFFER   (256*1024)  /* Initial size of the JPEG stream buffer */
+
+struct audio_batch {
+    int chunks;
+    int ready;          /* Non-zero while the batch is waiting to be written */
+    Uint8 *pcm;         /* Warm-up samples followed by the batch */
+    Uint8 *encoded;
+    Uint32 *size;       /* PCM bytes in each chunk of the batch */
+    struct adpcm_state *state;  /* Starting state of each chunk */
+};
+
+struct audio_encoder {
+    FILE *input;
+    Uint32 left;        /* PCM bytes not read yet */
+    Uint32 framesize;   /* PCM bytes in a full chunk */
+    Uint32 stride;      /* Bytes reserved for each encoded chunk */
+    int channels;
+    int threads;
+    int error;
+    int seeded;         /* Non-zero if PCM comes before the batch */
+    struct adpcm_state carry[255];
+    struct audio_batch batch[2];
+    struct audio_batch *work;   /* Batch being encoded */
+    int current;        /* Batch being written */
+    int next;           /* Next chunk in that batch to be written */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct audio_worker {
+        struct audio_encoder *encoder;
+        int id;
+        pthread_t thread;
+    } *worker;
+};
+
+/* Work out the state a chunk starts with from the samples before it */
+static void SeedAudioChunk(short *pcm, int channels, struct adpcm_state *state)
+{
+    Uint8 scratch[(AUDIO_WARMUP*255)/2+1];
+    int i;
+
+    for ( i = 0; i < channels; ++i ) {
+        state[i].valprev = pcm[i];
+        state[i].index = 0;
+    }
+    SMJPEG_adpcm_coder(pcm, (char *)scratch, AUDIO_WARMUP*channels, channels, state);
+}
+
+/* Encode every threads'th chunk of the batch */
+static void *EncodeAudioChunks(void *data)
+{
+    struct audio_worker *worker = (struct audio_worker *)data;
+    struct audio_encoder *encoder = worker->encoder;
+    struct audio_batch *batch = encoder->work;
+    struct adpcm_state state[255];
+    Uint32 warmup;
+    short *pcm;
+    int channels;
+    int i;
+
+    channels = encoder->channels;
+    warmup = AUDIO_WARMUP*channels*2;
+    for ( i = worker->id; i < batch->chunks; i += encoder->threads ) {
+        pcm = (short *)(batch->pcm + warmup + i*encoder->framesize);
+        if ( i > 0 || encoder->seeded ) {
+            SeedAudioChunk(pcm - AUDIO_WARMUP*channels, channels, state);
+        } else {
+            memset(state, 0, channels*sizeof(state[0]));
+        }
+        memcpy(&batch->state[i*channels], state, channels*sizeof(state[0]));
+        SMJPEG_adpcm_coder(pcm, (char *)batch->encoded + i*encoder->stride,
+                           batch->size[i]/2, channels, state);
+    }
+    return(NULL);
+}
+
+/* Encode the chunks of a batch in order, carrying the state between them */
+static void CarryAudioChunks(struct audio_encoder *encoder)
+{
+    struct audio_batch *batch = encoder->work;
+    int channels;
+    int i;
+
+    channels = encoder->channels;
+    for ( i = 0; i < batch->chunks; ++i ) {
+        memcpy(&batch->state[i*channels], encoder->carry,
+               channels*sizeof(encoder->carry[0]));
+        SMJPEG_adpcm_coder((short *)(batch->pcm + AUDIO_WARMUP*channels*2 +
+                                     i*encoder->framesize),
+                           (char *)batch->encoded + i*encoder->stride,
+                           batch->size[i]/2, channels, encoder->carry);
+    }
+}
+
+/* Read and encode the next batch of chunks */
+static int EncodeAudioBatch(struct audio_encoder *encoder,
+                            struct audio_batch *batch,
+                            struct audio_batch *last)
+{
+    Uint32 warmup;
+    Uint32 total;
+    Uint32 size;
+    int len;
+    int created;
+    int i;
+
+    /* Keep the end of the last batch to seed the first chunk */
+    warmup = AUDIO_WARMUP*encoder->channels*2;
+    if ( last->chunks > 0 ) {
+        memcpy(batch->pcm,
+               last->pcm + last->chunks*encoder->framesize, warmup);
+        encoder->seeded = 1;
+    }
+
+    batch->chunks = 0;
+    total = 0;
+    while ( (batch->chunks < encoder->threads*AUDIO_BATCH) &&
+            (encoder->left > 0) ) {
+        size = encoder->framesize;
+        if ( size > encoder->left ) {
+            size = encoder->left;
+        }
+        batch->size[batch->chunks++] = size;
+        encoder->left -= size;
+        total += size;
+    }
+    len = fread(batch->pcm + warmup, 1, total, encoder->input);
+    if ( len < total ) {
+        fprintf(stderr, "Error reading input data\n");
+        return(-1);
+    }
+
+    encoder->work = batch;
+    if ( encoder->threads == 1 ) {
+        CarryAudioChunks(encoder);
+        return(0);
+    }
+    for ( i = 0; i < encoder->threads; ++i ) {
+        if ( pthread_create(&encoder->worker[i].thread, NULL,
+                            EncodeAudioChunks, &encoder->worker[i]) != 0 ) {
+            break;
+        }
+    }
+    if ( i == 0 ) {
+        fprintf(stderr, "Unable to create audio encoding thread\n");
+        return(-1);
+    }
+    created = i;
+    while ( i < encoder->threads ) {
+        /* Out of threads, do the rest here */
+        EncodeAudioChunks(&encoder->worker[i++]);
+    }
+    for ( i = 0; i < created; ++i ) {
+        pthread_join(encoder->worker[i].thread, NULL);
+    }
+    return(0);
+}
+
+/* Fill the two batches in turn as the main thread writes them out */
+static void *EncodeAudio(void *data)
+{
+    struct audio_encoder *encoder = (struct audio_encoder *)data;
+    struct audio_batch *batch;
+    int status;
+    int i;
+
+    for ( i = 0; encoder->left > 0; i ^= 1 ) {
+        batch = &encoder->batch[i];
+        pthread_mutex_lock(&encoder->lock);
+        while ( batch->ready ) {
+            pthread_cond_wait(&encoder->cond, &encoder->lock);
+        }
+        pthread_mutex_unlock(&encoder->lock);
+
+        status = EncodeAudioBatch(encoder, batch, &encoder->batch[i^1]);
+
+        pthread_mutex_lock(&encoder->lock);
+        if ( status < 0 ) {
+            encoder->error = 1;
+        }
+        batch->ready = 1;
+        pthread_cond_broadcast(&encoder->cond);
+        pthread_mutex_unlock(&encoder->lock);
+        if ( status < 0 ) {
+            break;
+        }
+    }
+    return(NULL);
+}
+
+struct audio_encoder *CreateAudioEncoder(FILE *input, Uint32 size,
+                                         Uint32 framesize, Uint8 channels,
+                                         int threads)
+{
+    struct audio_encoder *encoder;
+    struct audio_batch *batch;
+    int chunks;
+    int i;
+
+    encoder = (struct audio_encoder *)malloc(sizeof(*encoder));
+    if ( encoder == NULL ) {
+        return(NULL);
+    }
+    memset(encoder, 0, sizeof(*encoder));
+    chunks = threads*AUDIO_BATCH;
+    encoder->input = input;
+    encoder->left = size;
+    encoder->framesize = framesize;
+    encoder->stride = framesize/4 + 1;
+    encoder->channels = channels;
+    encoder->threads = threads;
+    for ( i = 0; i < 2; ++i ) {
+        batch = &encoder->batch[i];
+        batch->pcm = (Uint8 *)malloc(AUDIO_WARMUP*channels*2 +
+                                     chunks*framesize);
+        batch->encoded = (Uint8 *)malloc(chunks*encoder->stride);
+        batch->size = (Uint32 *)malloc(chunks*sizeof(Uint32));
+        batch->state = (struct adpcm_state *)malloc(chunks*channels*
+                                           sizeof(struct adpcm_state));
+        if ( !batch->pcm || !batch->encoded || !batch->size ||
+             !batch->state ) {
+            return(NULL);
+        }
+    }
+    encoder->worker = (struct audio_worker *)malloc(threads*
+                                           sizeof(struct audio_worker));
+    if ( encoder->worker == NULL ) {
+        return(NULL);
+    }
+    for ( i = 0; i < threads; ++i ) {
+        encoder->worker[i].encoder = encoder;
+        encoder->worker[i].id = i;
+    }
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->cond, NULL);
+    if ( pthread_create(&encoder->thread, NULL, EncodeAudio, encoder) != 0 ) {
+        fprintf(stderr, "Unable to create audio encoding thread\n");
+        return(NULL);
+    }
+    pthread_detach(encoder->thread);
+    return(encoder);
+}
+
+int WriteEncodedAudioChunk(struct audio_encoder *encoder, double timestamp,
+                           FILE *output)
+{
+    struct audio_batch *batch;
+    struct adpcm_state *state;
+    Uint8 header[12+255*4];
+    Uint8 *p;
+    Uint32 size;
+    int i;
+
+    batch = &encoder->batch[encoder->current];
+    if ( encoder->next == 0 ) {
+        pthread_mutex_lock(&encoder->lock);
+        while ( ! batch->ready ) {
+            pthread_cond_wait(&encoder->cond, &encoder->lock);
+        }
+        pthread_mutex_unlock(&encoder->lock);
+        if ( encoder->error ) {
+            return(-1);
+        }
+    }
+    size = batch->size[encoder->next];
+    state = &batch->state[encoder->next*encoder->channels];
+
+    memcpy(header, AUDIO_DATA_MAGIC, 4);
+    PUT32(header+4, (Uint32)timestamp);
+    PUT32(header+8, (encoder->channels*4)+(size/4));
+    p = header+12;
+    for ( i = 0; i < encoder->channels; i++ ) {
+        PUT16(p, state[i].valprev);
+        p[2] = state[i].index;
+        p[3] = 0;
+        p += 4;
+    }
+    fwrite(header, p-header, 1, output);
+    fwrite(batch->encoded + encoder->next*encoder->stride, size/4, 1, output);
+
+    /* Hand the batch back once it has all been written */
+    if ( ++encoder->next == batch->chunks ) {
+        pthread_mutex_lock(&encoder->lock);
+        batch->ready = 0;
+        pthread_cond_broadcast(&encoder->cond);
+        pthread_mutex_unlock(&encoder->lock);
+        encoder->current ^= 1;
+        encoder->next = 0;
+    }
+    return(0);
+}
+
+struct frame_reader {
+    const char *names;  /* Format of the frame file names */
+    FILE *stream;       /* Frame stream, or NULL to read frame files */
+    int split;          /* Non-zero if the stream is JPEG frames back to back */
+    int compress;       /* Non-zero if the frames need to be compressed */
+    int width;          /* Size of the raw frames */
+    int height;
+    int quality;        /* JPEG quality of compressed frames */
+    Uint32 frames;
+    Uint32 claimed;     /* Frames taken by the reader threads */
+    Uint32 written;     /* Frames written out by the main thread */
+    int slots;
+    struct frame_slot {
+        Uint32 frame;
+        int ready;      /* Non-zero when the frame has been read */
+        int error;      /* Error number if the frame couldn't be read */
+        Uint8 *data;
+        Uint32 size;
+        Uint32 maxsize;
+        Uint8 *pixels;  /* Raw frame waiting to be compressed */
+        Uint16 width;   /* Size of a frame split from the stream */
+        Uint16 height;
+    } *slot;
+    Uint8 *buffer;      /* Data read from a stream of JPEG frames */
+    Uint32 buffered;
+    Uint32 bufsize;
+    Uint32 consumed;    /* Bytes of the buffer taken by the last frame */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t stream_lock;    /* Keeps stream frames read in order */
+};
+
+/* Compressed frames are written straight into the frame slot */
+struct frame_destination_mgr {
+    struct jpeg_destination_mgr pub;
+
+    struct frame_slot *slot;
+};
+
+/* Called by jpeg_start_compress before any data is written */
+static void jpegdest_init (j_compress_ptr cinfo)
+{
+    struct frame_destination_mgr *dest = (struct frame_destination_mgr *)cinfo->dest;
+    struct frame_slot *slot = dest->slot;
+
+    if ( slot->maxsize == 0 ) {
+        slot->data = (Uint8 *)malloc(BUFSIZ);
+        if ( slot->data == NULL ) {
+            ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+        }
+        slot->maxsize = BUFSIZ;
+    }
+    dest->pub.next_output_byte = slot->data;
+    dest->pub.free_in_buffer = slot->maxsize;
+}
+
+/*
+ * Empty the output buffer --- called whenever buffer fills up.
+ * The buffer is the whole frame, so make it bigger.
+ */
+static int jpegdest_empty (j_compress_ptr cinfo)
+{
+    struct frame_destination_mgr *dest = (struct frame_destination_mgr *)cinfo->dest;
+    struct frame_slot *slot = dest->slot;
+    Uint8 *data;
+
+    data = (Uint8 *)realloc(slot->data, slot->maxsize*2);
+    if ( data == NULL ) {
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+    slot->data = data;
+    dest->pub.next_output_byte = data + slot->maxsize;
+    dest->pub.free_in_buffer = slot->maxsize;
+    slot->maxsize *= 2;
+    return(TRUE);
+}
+
+/* Called by jpeg_finish_compress after all data has been written */
+static void jpegdest_term (j_compress_ptr cinfo)
+{
+    struct frame_destination_mgr *dest = (struct frame_destination_mgr *)cinfo->dest;
+
+    dest->slot->size = dest->slot->maxsize - dest->pub.free_in_buffer;
+}
+
+static void jpeg_frame_dest (j_compress_ptr cinfo, struct frame_slot *slot,
+                             struct frame_destination_mgr *dest)
+{
+    cinfo->dest = (struct jpeg_destination_mgr *)dest;
+    dest->slot = slot;
+    dest->pub.init_destination = jpegdest_init;
+    dest->pub.empty_output_buffer = jpegdest_empty;
+    dest->pub.term_destination = jpegdest_term;
+}
+
+/* Read a whole frame file into a slot */
+static int ReadFrameFile(const char *file, struct frame_slot *slot)
+{
+    FILE *input;
+    struct stat sb;
+    Uint8 *data;
+
+    input = fopen(file, "rb");
+    if ( input == NULL ) {
+        return(-1);
+    }
+    if ( fstat(fileno(input), &sb) < 0 ) {
+        fclose(input);
+        return(-1);
+    }
+    slot->size = sb.st_size;
+    if ( slot->size > slot->maxsize ) {
+        data = (Uint8 *)realloc(slot->data, slot->size);
+        if ( data == NULL ) {
+            fclose(input);
+            errno = ENOMEM;
+            return(-1);
+        }
+        slot->data = data;
+        slot->maxsize = slot->size;
+    }
+    if ( fread(slot->data, 1, slot->size, input) < slot->size ) {
+        if ( ! ferror(input) ) {
+            errno = EIO;
+        }
+        fclose(input);
+        return(-1);
+    }
+    fclose(input);
+    return(0);
+}
+
+/* Compress an image file into a slot */
+static int CompressFrameFile(struct frame_reader *reader,
+                             j_compress_ptr cinfo,
+                             struct frame_destination_mgr *dest,
+                             const char *file, struct frame_slot *slot)
+{
+    FILE *input;
+    cjpeg_source_ptr source;
+    JDIMENSION rows;
+
+    input = fopen(file, "rb");
+    if ( input == NULL ) {
+        return(-1);
+    }
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    source = select_image_reader(cinfo, input);
+    source->input_file = input;
+    (*source->start_input)(cinfo, source);
+    jpeg_default_colorspace(cinfo);
+    jpeg_set_quality(cinfo, reader->quality, TRUE);
+
+    jpeg_frame_dest(cinfo, slot, dest);
+    jpeg_start_compress(cinfo, TRUE);
+    while ( cinfo->next_scanline < cinfo->image_height ) {
+        rows = (*source->get_pixel_rows)(cinfo, source);
+        jpeg_write_scanlines(cinfo, source->buffer, rows);
+    }
+    (*source->finish_input)(cinfo, source);
+    jpeg_finish_compress(cinfo);
+    fclose(input);
+    return(0);
+}
+
+/* Read the next raw frame of the stream into a slot
+   This returns 1 at the end of the stream.
+ */
+static int ReadRawFrame(struct frame_reader *reader, struct frame_slot *slot)
+{
+    Uint32 size;
+    Uint32 len;
+
+    size = reader->width*reader->height*3;
+    if ( slot->pixels == NULL ) {
+        slot->pixels = (Uint8 *)malloc(size);
+        if ( slot->pixels == NULL ) {
+            errno = ENOMEM;
+            return(-1);
+        }
+    }
+    len = fread(slot->pixels, 1, size, reader->stream);
+    if ( len < size ) {
+        if ( ferror(reader->stream) ) {
+            return(-1);
+        }
+        if ( len > 0 ) {
+            fprintf(stderr, "Warning: incomplete frame at end of input\n");
+        }
+        return(1);
+    }
+    return(0);
+}
+
+/* Read until at least len bytes of the frame stream are buffered after pos
+   This returns 0 at the end of the stream.  It uses read() rather than
+   fread() so that frames are passed on as soon as they come in.
+ */
+static int FillStream(struct frame_reader *reader, Uint32 pos, Uint32 len)
+{
+    Uint8 *buffer;
+    ssize_t got;
+
+    while ( reader->buffered < pos+len ) {
+        if ( reader->buffered == reader->bufsize ) {
+            buffer = (Uint8 *)realloc(reader->buffer, reader->bufsize*2);
+            if ( buffer == NULL ) {
+                errno = ENOMEM;
+                return(-1);
+            }
+            reader->buffer = buffer;
+            reader->bufsize *= 2;
+        }
+        got = read(fileno(reader->stream), reader->buffer+reader->buffered,
+                   reader->bufsize-reader->buffered);
+        if ( got < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return(-1);
+        }
+        if ( got == 0 ) {
+            return(0);
+        }
+        reader->buffered += got;
+    }
+    return(1);
+}
+
+/* Split the next frame off the stream of JPEG frames into a slot
+   A frame runs from an SOI marker to the matching EOI marker.  Marker
+   segments are skipped by their length, so that thumbnails inside them
+   don't end the frame early, and the entropy-coded data after SOS is
+   searched for the next marker with memchr().
+   This returns 1 at the end of the stream.
+ */
+static int ReadStreamFrame(struct frame_reader *reader,
+                           struct frame_slot *slot)
+{
+    Uint8 *buffer;
+    Uint8 *p;
+    Uint32 start, pos, len;
+    int marker;
+    int entropy;
+    int status;
+
+    /* Drop the last frame */
+    if ( reader->consumed > 0 ) {
+        memmove(reader->buffer, reader->buffer+reader->consumed,
+                reader->buffered-reader->consumed);
+        reader->buffered -= reader->consumed;
+        reader->consumed = 0;
+    }
+
+    /* Find the start of the frame, skipping anything before it */
+    pos = 0;
+    for ( ; ; ) {
+        status = FillStream(reader, pos, 2);
+        if ( status <= 0 ) {
+            return(status < 0 ? -1 : 1);
+        }
+        buffer = reader->buffer;
+        p = (Uint8 *)memchr(buffer+pos, 0xFF, reader->buffered-pos-1);
+        if ( p == NULL ) {
+            buffer[0] = buffer[reader->buffered-1];
+            reader->buffered = 1;
+            pos = 0;
+            continue;
+        }
+        pos = p - buffer;
+        if ( buffer[pos+1] == JPEG_SOI ) {
+            break;
+        }
+        ++pos;
+    }
+    start = pos;
+    pos += 2;
+
+    /* Find the end of the frame */
+    slot->width = 0;
+    slot->height = 0;
+    entropy = 0;
+    for ( ; ; ) {
+        status = FillStream(reader, pos, 2);
+        if ( status <= 0 ) {
+            break;
+        }
+        buffer = reader->buffer;
+        if ( entropy || (buffer[pos] != 0xFF) ) {
+            p = (Uint8 *)memchr(buffer+pos, 0xFF, reader->buffered-pos-1);
+            if ( p == NULL ) {
+                pos = reader->buffered-1;
+                continue;
+            }
+            pos = p - buffer;
+            marker = buffer[pos+1];
+            if ( (marker == 0x00) ||
+                 ((marker >= JPEG_RST0) && (marker <= JPEG_RST0+7)) ) {
+                /* Stuffed zero byte or restart marker */
+                pos += 2;
+                continue;
+            }
+            entropy = 0;
+        }
+        marker = buffer[pos+1];
+        if ( marker == 0xFF ) {
+            /* Fill byte before a marker */
+            ++pos;
+            continue;
+        }
+        if ( marker == JPEG_EOI ) {
+            pos += 2;
+            break;
+        }
+        if ( marker == JPEG_SOI ) {
+            fprintf(stderr, "Warning: incomplete frame in input stream\n");
+            start = pos;
+            pos += 2;
+            slot->width = 0;
+            slot->height = 0;
+            continue;
+        }
+        if ( (marker == 0x01) ||
+             ((marker >= JPEG_RST0) && (marker <= JPEG_RST0+7)) ) {
+            /* Markers without a segment */
+            pos += 2;
+            continue;
+        }
+        status = FillStream(reader, pos, 4);
+        if ( status <= 0 ) {
+            break;
+        }
+        buffer = reader->buffer;
+        len = GET16(buffer+pos+2);
+        if ( (marker >= 0xC0) && (marker <= 0xCF) &&
+             (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC) ) {
+            /* Start of frame, with the image size */
+            status = FillStream(reader, pos, 9);
+            if ( status <= 0 ) {
+                break;
+            }
+            buffer = reader->buffer;
+            slot->height = GET16(buffer+pos+5);
+            slot->width = GET16(buffer+pos+7);
+        }
+        pos += 2 + len;
+        if ( marker == 0xDA ) {
+            /* Start of scan, entropy-coded data follows */
+            entropy = 1;
+        }
+    }
+    if ( status < 0 ) {
+        return(-1);
+    }
+    if ( status == 0 ) {
+        fprintf(stderr, "Warning: incomplete frame at end of input\n");
+        return(1);
+    }
+
+    /* Hand the frame over */
+    slot->size = pos - start;
+    if ( slot->size > slot->maxsize ) {
+        p = (Uint8 *)realloc(slot->data, slot->size);
+        if ( p == NULL ) {
+            errno = ENOMEM;
+            return(-1);
+        }
+        slot->data = p;
+        slot->maxsize = slot->size;
+    }
+    memcpy(slot->data, reader->buffer+start, slot->size);
+    reader->consumed = pos;
+    return(0);
+}
+
+/* Compress the raw frame in a slot */
+static void CompressRawFrame(struct frame_reader *reader,
+                             j_compress_ptr cinfo,
+                             struct frame_destination_mgr *dest,
+                             struct frame_slot *slot)
+{
+    JSAMPROW rows[16];
+    JDIMENSION row;
+    int i;
+
+    cinfo->image_width = reader->width;
+    cinfo->image_height = reader->height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, reader->quality, TRUE);
+
+    jpeg_frame_dest(cinfo, slot, dest);
+    jpeg_start_compress(cinfo, TRUE);
+    while ( cinfo->next_scanline < cinfo->image_height ) {
+        row = cinfo->next_scanline;
+        for ( i = 0; (i < 16) && (row < cinfo->image_height); ++i, ++row ) {
+            rows[i] = slot->pixels + row*reader->width*3;
+        }
+        jpeg_write_scanlines(cinfo, rows, i);
+    }
+    jpeg_finish_compress(cinfo);
+}
+
+/* Read frames into free slots until all have been read */
+static void *ReadFrames(void *data)
+{
+    struct frame_reader *reader = (struct frame_reader *)data;
+    struct frame_slot *slot;
+    struct jpeg_error_mgr errmgr;
+    struct jpeg_compress_struct cinfo;
+    struct frame_destination_mgr dest;
+    char file[PATH_MAX];
+    Uint32 frame;
+    int status;
+
+    if ( reader->compress ) {
+        cinfo.err = jpeg_std_error(&errmgr);
+        errmgr.addon_message_table = cdjpeg_message_table;
+        errmgr.first_addon_message = JMSG_FIRSTADDONCODE;
+        errmgr.last_addon_message = JMSG_LASTADDONCODE;
+        jpeg_create_compress(&cinfo);
+    }
+    for ( ; ; ) {
+        if ( reader->stream ) {
+            pthread_mutex_lock(&reader->stream_lock);
+        }
+        pthread_mutex_lock(&reader->lock);
+        while ( (reader->claimed < reader->frames) &&
+                (reader->claimed >= reader->written + reader->slots) ) {
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        }
+        if ( reader->claimed >= reader->frames ) {
+            pthread_mutex_unlock(&reader->lock);
+            if ( reader->stream ) {
+                pthread_mutex_unlock(&reader->stream_lock);
+            }
+            break;
+        }
+        frame = reader->claimed++;
+        slot = &reader->slot[frame % reader->slots];
+        pthread_mutex_unlock(&reader->lock);
+
+        if ( reader->stream ) {
+            if ( reader->split ) {
+                status = ReadStreamFrame(reader, slot);
+            } else {
+                status = ReadRawFrame(reader, slot);
+            }
+            pthread_mutex_unlock(&reader->stream_lock);
+            if ( status > 0 ) {
+                /* That's all the frames there are */
+                pthread_mutex_lock(&reader->lock);
+                reader->frames = frame;
+                pthread_cond_broadcast(&reader->cond);
+                pthread_mutex_unlock(&reader->lock);
+                break;
+            }
+            if ( (status == 0) && reader->compress ) {
+                CompressRawFrame(reader, &cinfo, &dest, slot);
+            }
+        } else {
+            sprintf(file, reader->names, frame+1);
+            if ( reader->compress ) {
+                status = CompressFrameFile(reader, &cinfo, &dest, file, slot);
+            } else {
+                status = ReadFrameFile(file, slot);
+            }
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        slot->frame = frame;
+        slot->error = (status < 0) ? errno : 0;
+        slot->ready = 1;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    if ( reader->compress ) {
+        jpeg_destroy_compress(&cinfo);
+    }
+    return(NULL);
+}
+
+struct frame_reader *CreateFrameReader(const char *names, Uint32 frames,
+                                       int slots)
+{
+    struct frame_reader *reader;
+
+    reader = (struct frame_reader *)malloc(sizeof(*reader));
+    if ( reader == NULL ) {
+        return(NULL);
+    }
+    memset(reader, 0, sizeof(*reader));
+    reader->names = names;
+    reader->frames = frames;
+    reader->slots = slots;
+    reader->slot = (struct frame_slot *)malloc(slots*sizeof(*reader->slot));
+    if ( reader->slot == NULL ) {
+        return(NULL);
+    }
+    memset(reader->slot, 0, slots*sizeof(*reader->slot));
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    pthread_mutex_init(&reader->stream_lock, NULL);
+    return(reader);
+}
+
+/* Start reading (and compressing, if set up) frames on the given number
+   of threads, up to one per slot.
+ */
+int StartFrameReader(struct frame_reader *reader, int threads)
+{
+    pthread_t thread;
+    int i;
+
+    if ( threads > reader->slots ) {
+        threads = reader->slots;
+    }
+    for ( i = 0; i < threads; ++i ) {
+        if ( pthread_create(&thread, NULL, ReadFrames, reader) != 0 ) {
+            break;
+        }
+        pthread_detach(thread);
+    }
+    if ( i == 0 ) {
+        fprintf(stderr, "Unable to create frame reading thread\n");
+        return(-1);
+    }
+    return(0);
+}
+
+/* Wait for the next frame in order to be read, or return NULL if there
+   are no more frames.
+ */
+struct frame_slot *GetFrame(struct frame_reader *reader)
+{
+    struct frame_slot *slot;
+
+    slot = &reader->slot[reader->written % reader->slots];
+    pthread_mutex_lock(&reader->lock);
+    while ( (reader->written < reader->frames) &&
+            (!slot->ready || (slot->frame != reader->written)) ) {
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    }
+    if ( reader->written >= reader->frames ) {
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return(slot);
+}
+
+/* Give the slot of a frame that has been written back to the readers */
+void ReleaseFrame(struct frame_reader *reader, struct frame_slot *slot)
+{
+    pthread_mutex_lock(&reader->lock);
+    slot->ready = 0;
+    ++reader->written;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+#endif /* HAVE_PTHREAD_H */
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+/* Copy data between two files inside the kernel, returning the number of
+   bytes copied.  A method that fails isn't tried again, and anything left
+   over is copied by the caller.
+ */
+static int use_copy_file_range = 1;
+static int use_sendfile = 1;
+
+static Uint32 CopyFileData(int in, int out, Uint32 size)
+{
+    Uint32 copied;
+    ssize_t len;
+
+    copied = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    while ( use_copy_file_range && (copied < size) ) {
+        len = copy_file_range(in, NULL, out, NULL, size-copied, 0);
+        if ( len < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            use_copy_file_range = 0;
+        }
+        if ( len <= 0 ) {
+            break;
+        }
+        copied += len;
+    }
+#endif
+#ifdef HAVE_SENDFILE
+    while ( use_sendfile && (copied < size) ) {
+        len = sendfile(out, in, NULL, size-copied);
+        if ( len < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            use_sendfile = 0;
+        }
+        if ( len <= 0 ) {
+            break;
+        }
+        copied += len;
+    }
+#endif
+    return(copied);
+}
+#endif /* HAVE_COPY_FILE_RANGE || HAVE_SENDFILE */
+
 int WriteVideoChunk(FILE *input, double timestamp, Uint32 size,
                              const char *encoding, FILE *output)
 {
     Uint8 buffer[BUFSIZ];
     int len;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+    long offset;
+    Uint32 copied;
+#endif
 
 //fprintf(stderr, "V");
     fwrite(VIDEO_DATA_MAGIC, 4, 1, output);
     WRITE32((Uint32)timestamp, output);
     WRITE32(size, output);
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+    /* Move the frame straight from the input file to the output file,
+       flushing the stream first and then seeking past what was copied,
+       since stdio doesn't know the file position has moved.
+     */
+    if ( (size > 0) && (use_copy_file_range || use_sendfile) ) {
+        offset = ftell(output);
+        if ( (offset >= 0) && (fflush(output) == 0) ) {
+            copied = CopyFileData(fileno(input), fileno(output), size);
+            if ( copied > 0 ) {
+                fseek(output, offset+copied, SEEK_SET);
+                size -= copied;
+            }
+        }
+    }
+#endif
     while ( size > 0 ) {
         if ( size < BUFSIZ ) {
             len = fread(buffer, 1, size, input);
         } else {
             len = fread(buffer, 1, BUFSIZ, input);
         }
-        if ( len < 0 ) {
+        if ( len <= 0 ) {
             if ( ferror(input) ) {
                 fprintf(stderr, "Error reading input data\n");
             }
@@ -137,11 +1259,33 @@ int WriteVideoChunk(FILE *input, double timestamp, Uint32 size,
     return(0);
 }
 
+/* Write a video chunk for a frame that has already been read */
+int WriteVideoData(const Uint8 *data, double timestamp, Uint32 size,
+                   FILE *output)
+{
+    Uint8 header[12];
+
+    memcpy(header, VIDEO_DATA_MAGIC, 4);
+    PUT32(header+4, (Uint32)timestamp);
+    PUT32(header+8, size);
+    fwrite(header, sizeof(header), 1, output);
+    fwrite(data, size, 1, output);
+    return(0);
+}
+
 void Usage(const char *argv0)
 {
     printf("SMJPEG " VERSION " encoder, Loki Entertainment Software and Fat N Soft\n");
-    printf("Usage: %s [-r fps] [-c channels] [-n input] [-1]\n", argv0);
+    printf("Usage: %s [-r fps] [-c channels] [-n input] [-m file] [-i] [-j threads] [-t threads] [-p frames] [-s WxH] [-q quality] [-1]\n", argv0);
     printf("If no FPS is given it will calculate it based on the nubmer of video frames and length of audio\n");
+    printf("-i writes a seek index at the end of the file.\n");
+    printf("-j encodes the audio on the given number of threads.\n");
+    printf("-t compresses frames on the given number of threads (default: as -j).\n");
+    printf("-p reads up to the given number of frames ahead on other threads.\n");
+    printf("-m reads JPEG frames stored back to back from a file, or standard input if -.\n");
+    printf("-s reads raw 24-bit RGB frames of the given size from standard input.\n");
+    printf("Input frames that aren't JPEG files (PPM, BMP or Targa) and raw frames\n");
+    printf("are compressed with the quality given with -q (default %d).\n", DEFAULT_JPEG_QUALITY);
 }
 
 int main(int argc, char *argv[])
@@ -161,7 +1305,7 @@ int main(int argc, char *argv[])
     char jpegprefix[PATH_MAX], jpegfile[PATH_MAX];
     char audiofile[PATH_MAX];
     char outputfile[PATH_MAX];
-    FILE *jpeginput, *audioinput, *output;
+    FILE *jpeginput, *mjpeginput, *audioinput, *output;
     Uint32 audio_left;
     Uint32 audio_framesize;
     Uint32 video_framesize;
@@ -170,8 +1314,25 @@ int main(int argc, char *argv[])
     double audio_time, video_time;
     int status;
     int fps_set;
+    int write_index;
+    Uint32 index_header;
+    Uint32 group_offset;
+    Uint32 chunk_offset;
     void *audio_data;
-    char* input_names[256];
+    int audio_threads;
+    int compress_threads;
+    int prefetch;
+    int compress;
+    int quality;
+    int raw_width;
+    int raw_height;
+    Uint32 video_header;
+#ifdef HAVE_PTHREAD_H
+    struct audio_encoder *audio_encoder;
+    struct frame_reader *frame_reader;
+    struct frame_slot *frame;
+#endif
+    char input_names[256];
 
     /* First, set default encoding parameters */
     audio_rate = DEFAULT_AUDIO_RATE;
@@ -187,6 +1348,17 @@ int main(int argc, char *argv[])
     strcpy(audiofile, DEFAULT_AUDIO_INPUT);
     strcpy(outputfile, DEFAULT_OUTPUT_FILE);
     fps_set = 0;
+    write_index = 0;
+    index_header = 0;
+    audio_threads = 1;
+    compress_threads = 0;
+    prefetch = 0;
+    compress = 0;
+    quality = DEFAULT_JPEG_QUALITY;
+    raw_width = 0;
+    raw_height = 0;
+    mjpeginput = NULL;
+    video_header = 0;
     strcpy(input_names, "%d.jpg");    
 
     /* Process command-line options */
@@ -210,27 +1382,160 @@ int main(int argc, char *argv[])
             index++;
             strcpy(input_names, argv[index]);
         }
+        if ( (strcmp(argv[index], "-m") == 0) && argv[index+1] ) {
+            ++index;
+            if ( strcmp(argv[index], "-") == 0 ) {
+                mjpeginput = stdin;
+            } else {
+                mjpeginput = fopen(argv[index], "rb");
+                if ( mjpeginput == NULL ) {
+                    fprintf(stderr, "Couldn't open %s: %s\n", argv[index],
+                                    strerror(errno));
+                    exit(1);
+                }
+            }
+        }
+        if ( strcmp(argv[index], "-i") == 0 ) {
+            write_index = 1;
+        }
+        if ( (strcmp(argv[index], "-j") == 0) && argv[index+1] ) {
+            ++index;
+            audio_threads = atoi(argv[index]);
+        }
+        if ( (strcmp(argv[index], "-t") == 0) && argv[index+1] ) {
+            ++index;
+            compress_threads = atoi(argv[index]);
+        }
+        if ( (strcmp(argv[index], "-p") == 0) && argv[index+1] ) {
+            ++index;
+            prefetch = atoi(argv[index]);
+        }
+        if ( (strcmp(argv[index], "-s") == 0) && argv[index+1] ) {
+            ++index;
+            if ( (sscanf(argv[index], "%dx%d", &raw_width, &raw_height) != 2) ||
+                 (raw_width <= 0) || (raw_height <= 0) ||
+                 (raw_width > 65535) || (raw_height > 65535) ) {
+                fprintf(stderr, "Invalid frame size: %s\n", argv[index]);
+                exit(1);
+            }
+        }
+        if ( (strcmp(argv[index], "-q") == 0) && argv[index+1] ) {
+            ++index;
+            quality = atoi(argv[index]);
+        }
             
     }
 
-    /* Count the number of jpeg frames */
-    index = 1;
-    do {
-        sprintf(jpegfile, input_names, index++);
-        fprintf(stderr, "%s", jpegfile);
-    } while ( access(jpegfile, R_OK) == 0 );
+    if ( compress_threads <= 0 ) {
+        compress_threads = audio_threads;
+    }
+
+    if ( raw_width ) {
+        /* Raw frames, counted now if they're in a file */
+        compress = 1;
+        video_width = raw_width;
+        video_height = raw_height;
+        video_nframes = FRAMES_UNKNOWN;
+        if ( (fstat(0, &sb) == 0) && S_ISREG(sb.st_mode) ) {
+            video_nframes = sb.st_size / (raw_width*raw_height*3);
+            if ( video_nframes == 0 ) {
+                fprintf(stderr, "No frames in the input stream - aborting!\n");
+                exit(1);
+            }
+        }
+    } else if ( mjpeginput ) {
+        /* JPEG frames back to back, counted as they are split apart */
+        video_nframes = FRAMES_UNKNOWN;
+    } else {
+        /* Count the number of jpeg frames */
+        index = 1;
+        do {
+            sprintf(jpegfile, input_names, index++);
+            fprintf(stderr, "%s", jpegfile);
+        } while ( access(jpegfile, R_OK) == 0 );
 
-    /* Double check that we have some frames */
-    video_nframes = index - 2;
-    if ( video_nframes == 0 ) {
-        fprintf(stderr, "Warning: no video stream - audio only\n");
+        /* Double check that we have some frames */
+        video_nframes = index - 2;
+        if ( video_nframes == 0 ) {
+            fprintf(stderr, "Warning: no video stream - audio only\n");
+        }
+
+        /* Get the width and height of the output movie */
+        if ( video_nframes > 0 ) {
+            sprintf(jpegfile, input_names, 1);
+            if ( is_jpeg_file(jpegfile) ) {
+                get_jpeg_dimensions(jpegfile, &video_width, &video_height);
+            } else {
+                compress = 1;
+                get_image_dimensions(jpegfile, &video_width, &video_height);
+            }
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    frame_reader = NULL;
+    if ( video_nframes && ((prefetch > 0) || compress || mjpeginput) ) {
+        if ( compress && (prefetch < 2*compress_threads) ) {
+            prefetch = 2*compress_threads;
+        }
+        if ( mjpeginput && (prefetch < 2) ) {
+            prefetch = 2;
+        }
+        frame_reader = CreateFrameReader(input_names, video_nframes, prefetch);
+        if ( frame_reader == NULL ) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+        if ( raw_width ) {
+            frame_reader->stream = stdin;
+            frame_reader->width = raw_width;
+            frame_reader->height = raw_height;
+        }
+        if ( mjpeginput ) {
+            frame_reader->stream = mjpeginput;
+            frame_reader->split = 1;
+            frame_reader->bufsize = STREAM_BUFFER;
+            frame_reader->buffer = (Uint8 *)malloc(STREAM_BUFFER);
+            if ( frame_reader->buffer == NULL ) {
+                fprintf(stderr, "Out of memory\n");
+                exit(2);
+            }
+        }
+        frame_reader->compress = compress;
+        frame_reader->quality = quality;
+        /* Frames are split from a stream in order, on one thread */
+        if ( StartFrameReader(frame_reader, compress ? compress_threads :
+                                            mjpeginput ? 1 :
+                                            READER_THREADS) < 0 ) {
+            exit(2);
+        }
     }
 
-    /* Get the width and height of the output movie */
-    if ( video_nframes > 0 ) {
-        sprintf(jpegfile, input_names, 1);
-        get_jpeg_dimensions(jpegfile, &video_width, &video_height);
+    /* Get the width and height of the output movie from the first frame
+       of a JPEG stream, which is left for the main loop to write.
+     */
+    if ( mjpeginput ) {
+        frame = GetFrame(frame_reader);
+        if ( frame == NULL ) {
+            fprintf(stderr, "No frames in the input stream - aborting!\n");
+            exit(1);
+        } else if ( frame->error ) {
+            fprintf(stderr, "Couldn't read frame 1: %s\n",
+                            strerror(frame->error));
+            exit(1);
+        } else if ( ! frame->width || ! frame->height ) {
+            fprintf(stderr, "Couldn't find the frame size in the input stream\n");
+            exit(1);
+        } else {
+            video_width = frame->width;
+            video_height = frame->height;
+        }
+    }
+#else
+    if ( compress || mjpeginput ) {
+        fprintf(stderr, "Compressing or splitting frames needs thread support\n");
+        exit(1);
     }
+#endif
 
     /* Check to see if there is any audio input */
     stat(audiofile, &sb);
@@ -240,7 +1545,7 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Warning: no audio stream - video only\n");
     }
     else {
-        if (fps_set == 0)
+        if ( (fps_set == 0) && (video_nframes != FRAMES_UNKNOWN) )
             video_fps = ((double)(video_nframes)/(((double)audio_left)/(audio_rate*(audio_bits/8)*audio_channels)));
     }
 
@@ -256,9 +1561,13 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Unable to write output to %s\n", outputfile);
         exit(2);
     }
+    setvbuf(output, NULL, _IOFBF, OUTPUT_BUFFER);
 
     /* Okay, now we're ready to rock! */
-    if ( video_nframes ) {
+    if ( video_nframes == FRAMES_UNKNOWN ) {
+        printf("Encoding %dx%d frames of %s encoded video at %2.2f FPS\n",
+          video_width, video_height, video_encoding, video_fps);
+    } else if ( video_nframes ) {
         printf("Encoding %d %dx%d frames of %s encoded video at %2.2f FPS\n",
           video_nframes, video_width, video_height, video_encoding, video_fps);
     }
@@ -270,7 +1579,11 @@ int main(int argc, char *argv[])
     /* Write the main header */
     fwrite(smjpeg_magic, sizeof(smjpeg_magic), 1, output);
     WRITE32(SMJPEG_FORMAT_VERSION, output);
-    WRITE32((Uint32)(((double)video_nframes/video_fps)*1000.0), output);
+    if ( video_nframes == FRAMES_UNKNOWN ) {
+        WRITE32(0, output);
+    } else {
+        WRITE32((Uint32)(((double)video_nframes/video_fps)*1000.0), output);
+    }
 
     /* Write the audio header */
     if ( audioinput ) {
@@ -284,16 +1597,27 @@ int main(int argc, char *argv[])
 
     /* Write the video header */
     if ( video_nframes ) {
+        video_header = ftell(output);
         fwrite(VIDEO_HEADER_MAGIC, 4, 1, output);
         WRITE32(12, output);
-        WRITE32(video_nframes, output);
+        WRITE32((video_nframes == FRAMES_UNKNOWN) ? 0 : video_nframes, output);
         WRITE16(video_width, output);
         WRITE16(video_height, output);
         fwrite(video_encoding, 4, 1, output);
     }
 
+    /* Write the index header, filled in once the data is written */
+    if ( write_index ) {
+        index_header = ftell(output);
+        fwrite(INDEX_HEADER_MAGIC, 4, 1, output);
+        WRITE32(8, output);
+        WRITE32(0, output);
+        WRITE32(0, output);
+    }
+
     /* Write the end of header marker */
     fwrite(HEADER_END_MAGIC, 4, 1, output);
+    group_offset = ftell(output);
 
     /* Create audio data for encoder */
     if (MAGIC_EQUALS(audio_encoding, AUDIO_ENCODING_ADPCM))
@@ -313,11 +1637,26 @@ int main(int argc, char *argv[])
 
     /* Multiplex the audio and video data */
     audio_framesize = DEFAULT_AUDIO_FRAME * (audio_bits / 8) * audio_channels;
+#ifdef HAVE_PTHREAD_H
+    audio_encoder = NULL;
+    if ( audioinput && audio_data && (audio_left > 0) &&
+         ((audio_threads > 1) || (prefetch > 0)) ) {
+        audio_encoder = CreateAudioEncoder(audioinput, audio_left,
+                                           audio_framesize, audio_channels,
+                                           (audio_threads > 1) ?
+                                           audio_threads : 1);
+        if ( audio_encoder == NULL ) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+    }
+#endif
     audio_time = 0.0;
     video_time = 0.0;
     ms_per_audio_frame = (1000.0 * DEFAULT_AUDIO_FRAME) / audio_rate;
     ms_per_video_frame = 1000.0 / video_fps;
     for ( index=1; index <= video_nframes; ++index ) {
+        group_offset = ftell(output);
 
         /* Encode audio for this frame and one frame ahead */
         while ( audioinput && (audio_left > 0) &&
@@ -325,9 +1664,18 @@ int main(int argc, char *argv[])
             if ( audio_framesize > audio_left ) {
                 audio_framesize = audio_left;
             }
-            WriteAudioChunk(audioinput, audio_time, audio_framesize,
-                            audio_encoding, output, audio_channels,
-                            audio_data);
+#ifdef HAVE_PTHREAD_H
+            if ( audio_encoder ) {
+                status = WriteEncodedAudioChunk(audio_encoder, audio_time,
+                                                output);
+            } else
+#endif
+            status = WriteAudioChunk(audioinput, audio_time, audio_framesize,
+                                     audio_encoding, output, audio_channels,
+                                     audio_data);
+            if ( status < 0 ) {
+                exit(3);
+            }
             audio_left -= audio_framesize;
             audio_time += ms_per_audio_frame;
 
@@ -335,11 +1683,47 @@ int main(int argc, char *argv[])
         }
 
         /* Encode the video for this frame */
+#ifdef HAVE_PTHREAD_H
+        if ( frame_reader ) {
+            frame = GetFrame(frame_reader);
+            if ( frame == NULL ) {
+                /* The end of a frame stream */
+                break;
+            }
+            if ( frame->error ) {
+                if ( frame_reader->stream ) {
+                    fprintf(stderr, "Couldn't read frame %d: %s\n", index,
+                                    strerror(frame->error));
+                } else {
+                    sprintf(jpegfile, input_names, index);
+                    fprintf(stderr, "Couldn't open %s: %s\n", jpegfile,
+                                    strerror(frame->error));
+                }
+                abort();
+            }
+            if ( write_index &&
+                 AddIndexEntry(video_time, group_offset, ftell(output),
+                               frame->size) < 0 ) {
+                exit(2);
+            }
+            WriteVideoData(frame->data, video_time, frame->size, output);
+            video_time += ms_per_video_frame;
+            ReleaseFrame(frame_reader, frame);
+
+            printf("V"); fflush(stdout);
+            continue;
+        }
+#endif
         sprintf(jpegfile, input_names, index);
         stat(jpegfile, &sb);
         video_framesize = sb.st_size;
         jpeginput = fopen(jpegfile, "rb");
         if ( jpeginput ) {
+            if ( write_index &&
+                 AddIndexEntry(video_time, group_offset, ftell(output),
+                               video_framesize) < 0 ) {
+                exit(2);
+            }
             WriteVideoChunk(jpeginput, video_time, video_framesize,
                                             video_encoding, output);
             video_time += ms_per_video_frame;
@@ -352,14 +1736,43 @@ int main(int argc, char *argv[])
 
         printf("V"); fflush(stdout);
     }
+    if ( video_nframes != index-1 ) {
+        /* The stream ended, and the group it was in has no frame */
+        video_nframes = index-1;
+        if ( video_nframes == 0 ) {
+            fprintf(stderr, "\nNo frames in the input stream - aborting!\n");
+            exit(1);
+        }
+    } else {
+        video_header = 0;   /* The headers are right as written */
+        group_offset = ftell(output);
+    }
+
     /* Finish writing any audio data that's left */
     while ( audioinput && (audio_left > 0) ) {
         if ( audio_framesize > audio_left ) {
             audio_framesize = audio_left;
         }
-        WriteAudioChunk(audioinput, audio_time, audio_framesize,
-                        audio_encoding, output, audio_channels,
-                        audio_data);
+        if ( write_index && ! video_nframes ) {
+            chunk_offset = ftell(output);
+            if ( AddIndexEntry(audio_time, chunk_offset, chunk_offset,
+                               (MAGIC_EQUALS(audio_encoding, AUDIO_ENCODING_ADPCM) ?
+                                (audio_channels*4)+(audio_framesize/4) :
+                                audio_framesize)) < 0 ) {
+                exit(2);
+            }
+        }
+#ifdef HAVE_PTHREAD_H
+        if ( audio_encoder ) {
+            status = WriteEncodedAudioChunk(audio_encoder, audio_time, output);
+        } else
+#endif
+        status = WriteAudioChunk(audioinput, audio_time, audio_framesize,
+                                 audio_encoding, output, audio_channels,
+                                 audio_data);
+        if ( status < 0 ) {
+            exit(3);
+        }
         audio_left -= audio_framesize;
         audio_time += ms_per_audio_frame;
 
@@ -367,8 +1780,23 @@ int main(int argc, char *argv[])
     }
 
     /* Write the end of data marker */
+    if ( write_index && ! video_nframes ) {
+        group_offset = ftell(output);
+    }
     fwrite(DATA_END_MAGIC, 4, 1, output);
 
+    /* Write the seek index */
+    if ( write_index && (WriteIndex(output, index_header, group_offset) < 0) ) {
+        exit(6);
+    }
+
+    /* Fill in the frame count and length if they weren't known */
+    if ( video_header &&
+         (WriteVideoLength(output, video_header, video_nframes,
+                           video_fps) < 0) ) {
+        exit(6);
+    }
+
     /* We're done! */
     printf("\n");
     if ( ferror(output) || (fclose(output) == EOF) ) {
@@ -13,10 +13,12 @@
 #define SMJPEG_FORMAT_VERSION   0
 #define AUDIO_HEADER_MAGIC      "_SND"
 #define VIDEO_HEADER_MAGIC      "_VID"
+#define INDEX_HEADER_MAGIC      "_IDX"
 #define HEADER_END_MAGIC        "HEND"
 #define AUDIO_DATA_MAGIC        "sndD"
 #define VIDEO_DATA_MAGIC        "vidD"
 #define DATA_END_MAGIC          "DONE"
+#define INDEX_DATA_MAGIC        "INDX"
 #define MAGIC_EQUALS(X, Y)       (memcmp(X, Y, 4) == 0)
 
 /* Macros to assist in reading/writing the SMJPEG file format */
@@ -36,6 +38,21 @@
     val <<= 8; \
     val |= (Uint8)fgetc(fp);
 
+#define GET16(p) \
+    ((((Uint16)(p)[0])<<8)|((Uint16)(p)[1]))
+#define GET32(p) \
+    ((((Uint32)(p)[0])<<24)|(((Uint32)(p)[1])<<16)| \
+     (((Uint32)(p)[2])<<8)|((Uint32)(p)[3]))
+
+#define PUT16(p, val) \
+    (p)[0] = (((Uint16)(val))>>8)&0xFF; \
+    (p)[1] = ((Uint16)(val))&0xFF;
+#define PUT32(p, val) \
+    (p)[0] = (((Uint32)(val))>>24)&0xFF; \
+    (p)[1] = (((Uint32)(val))>>16)&0xFF; \
+    (p)[2] = (((Uint32)(val))>>8)&0xFF; \
+    (p)[3] = ((Uint32)(val))&0xFF;
+
 #define WRITE8(val, fp) \
     fputc((Uint8)(val), fp);
 #define WRITE16(val, fp) \